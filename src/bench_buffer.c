@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "buffer.h"
+#include "mlvpn.h"
+
+/* Freebuffer microbenchmark
+ * The reorder buffer holds packets in a freebuffer in arrival order, and
+ * releases them in sequence order when they are drained. Fill a
+ * freebuffer of N entries in shuffled order, release every packet in
+ * sequence order, and print the cost per release: it should not depend
+ * on N.
+ * usage: bench_buffer [packets released per size]
+ */
+
+#define BENCH_MIN 64
+#define BENCH_MAX 65536
+
+static double
+bench_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double
+bench_freebuffer(unsigned int size, unsigned long total)
+{
+    freebuffer_t *freebuf = mlvpn_freebuffer_init(size);
+    mlvpn_pkt_t **pkts = calloc(size, sizeof(*pkts));
+    unsigned int *arrival = calloc(size, sizeof(*arrival));
+    unsigned int i, j, tmp;
+    unsigned long released = 0;
+    double elapsed = 0, start;
+
+    if (!pkts || !arrival)
+        fatal("bench", "memory allocation failed");
+    for (i = 0; i < size; i++) {
+        pkts[i] = mlvpn_pkt_alloc();
+        pkts[i]->seq = i;
+        arrival[i] = i;
+    }
+    for (i = size - 1; i > 0; i--) {
+        j = random() % (i + 1);
+        tmp = arrival[i];
+        arrival[i] = arrival[j];
+        arrival[j] = tmp;
+    }
+    while (released < total) {
+        for (i = 0; i < size; i++)
+            mlvpn_freebuffer_put(freebuf, pkts[arrival[i]]);
+        start = bench_now();
+        for (i = 0; i < size; i++)
+            mlvpn_freebuffer_free(freebuf, pkts[i]);
+        elapsed += bench_now() - start;
+        released += size;
+    }
+    for (i = 0; i < size; i++)
+        mlvpn_pkt_release(pkts[i]);
+    mlvpn_pkt_pool_unreserve(size);
+    free(arrival);
+    free(pkts);
+    return elapsed / released;
+}
+
+int
+main(int argc, char **argv)
+{
+    unsigned long total = 1 << 22;
+    unsigned int size;
+
+    if (argc > 1)
+        total = strtoul(argv[1], NULL, 10);
+    log_init(1, 0, "bench_buffer");
+    srandom(1);
+    printf("%10s %16s\n", "entries", "release (ns/pkt)");
+    for (size = BENCH_MIN; size <= BENCH_MAX; size *= 4)
+        printf("%10u %16.1f\n", size, bench_freebuffer(size, total));
+    return 0;
+}
@@ -23,6 +23,9 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <stdlib.h>
+#include <string.h>
+
 #include "buffer.h"
 #include "mlvpn.h"
 
@@ -67,6 +70,13 @@ mlvpn_cb_is_empty(const circular_buffer_t *buf)
     return buf->end == buf->start;
 }
 
+/* Number of elements stored */
+int
+mlvpn_cb_count(const circular_buffer_t *buf)
+{
+    return (buf->end - buf->start + buf->size) % buf->size;
+}
+
 /* Release and return the packet if available.
  * data must point to a valid location in memory
  * where the actual data is stored.
@@ -79,6 +89,12 @@ mlvpn_cb_read(circular_buffer_t *buf, void **data)
     return ret;
 }
 
+/* Return the oldest element without removing it */
+void *
+mlvpn_cb_read_norelease(const circular_buffer_t *buf, void **data)
+{
+    return data[buf->start];
+}
 
 /* Register & return a new packet.
  * See comment in cb_read for **data signification.
@@ -93,26 +109,160 @@ mlvpn_cb_write(circular_buffer_t *buf, void **data)
     return ret;
 }
 
+/**
+ * Packet pool
+ * A single pool of packets shared by every pktbuffer and the reorder
+ * buffer. Packets live in contiguous, cache line aligned slabs. Slabs
+ * are allocated when a pool user reserves packets (at configuration
+ * time), so the data path never calls malloc.
+ * Free packets are chained by index in a lock-free stack. The stack
+ * head carries a tag, incremented on every update, against ABA.
+ */
+#define PKT_CACHELINE 64
+#define PKT_SLOT_SIZE \
+    ((sizeof(mlvpn_pkt_t) + PKT_CACHELINE - 1) & ~(PKT_CACHELINE - 1))
+#define PKT_POOL_NIL UINT32_MAX
+#define PKT_POOL_CHUNK 256
+
+static struct {
+    uint32_t size;        /* packets allocated */
+    uint32_t reserved;    /* packets reserved by pool users */
+    uint32_t in_use;      /* packets currently allocated */
+    mlvpn_pkt_t **slots;  /* index -> packet */
+    uint32_t *next;       /* free stack links, by index */
+    uint64_t head;        /* tag << 32 | index of the first free packet */
+} pkt_pool = { 0, 0, 0, NULL, NULL, PKT_POOL_NIL };
+
+static void
+mlvpn_pkt_pool_push(uint32_t idx)
+{
+    uint64_t old = __atomic_load_n(&pkt_pool.head, __ATOMIC_ACQUIRE);
+    uint64_t new;
+    do {
+        pkt_pool.next[idx] = (uint32_t)old;
+        new = (((old >> 32) + 1) << 32) | idx;
+    } while (! __atomic_compare_exchange_n(&pkt_pool.head, &old, new, 1,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+}
+
+static uint32_t
+mlvpn_pkt_pool_pop()
+{
+    uint64_t old = __atomic_load_n(&pkt_pool.head, __ATOMIC_ACQUIRE);
+    uint64_t new;
+    uint32_t idx;
+    do {
+        idx = (uint32_t)old;
+        if (idx == PKT_POOL_NIL)
+            return PKT_POOL_NIL;
+        new = (((old >> 32) + 1) << 32) | pkt_pool.next[idx];
+    } while (! __atomic_compare_exchange_n(&pkt_pool.head, &old, new, 1,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    return idx;
+}
+
+/* Add a slab of count packets to the pool */
+static void
+mlvpn_pkt_pool_grow(uint32_t count)
+{
+    uint32_t i;
+    void *slab;
+    mlvpn_pkt_t **slots;
+    uint32_t *next;
+
+    if (posix_memalign(&slab, PKT_CACHELINE, count * PKT_SLOT_SIZE) != 0)
+        fatal("buffer", "memory allocation failed");
+    memset(slab, 0, count * PKT_SLOT_SIZE);
+    slots = realloc(pkt_pool.slots,
+        (pkt_pool.size + count) * sizeof(mlvpn_pkt_t *));
+    next = realloc(pkt_pool.next, (pkt_pool.size + count) * sizeof(uint32_t));
+    if (slots == NULL || next == NULL)
+        fatal("buffer", "memory allocation failed");
+    pkt_pool.slots = slots;
+    pkt_pool.next = next;
+    for(i = 0; i < count; i++) {
+        mlvpn_pkt_t *pkt = (mlvpn_pkt_t *)((char *)slab + i * PKT_SLOT_SIZE);
+        pkt->pool_idx = pkt_pool.size + i;
+        pkt_pool.slots[pkt->pool_idx] = pkt;
+    }
+    /* push in reverse order so packets are handed out in address order */
+    for(i = count; i > 0; i--)
+        mlvpn_pkt_pool_push(pkt_pool.size + i - 1);
+    pkt_pool.size += count;
+    log_debug("buffer", "packet pool: %u packets (%u reserved)",
+        pkt_pool.size, pkt_pool.reserved);
+}
+
+/* Make sure the pool holds at least size packets */
+void
+mlvpn_pkt_pool_prealloc(uint32_t size)
+{
+    if (size > pkt_pool.size)
+        mlvpn_pkt_pool_grow(size - pkt_pool.size);
+}
+
+/* Reserve count packets for a new pool user (a buffer holding at most
+ * count packets), growing the pool if needed. */
+void
+mlvpn_pkt_pool_reserve(uint32_t count)
+{
+    pkt_pool.reserved += count;
+    mlvpn_pkt_pool_prealloc(pkt_pool.reserved);
+}
+
+/* Give back a reservation. Memory is kept for later users. */
+void
+mlvpn_pkt_pool_unreserve(uint32_t count)
+{
+    pkt_pool.reserved -= MIN(count, pkt_pool.reserved);
+}
+
+mlvpn_pkt_t *
+mlvpn_pkt_alloc()
+{
+    mlvpn_pkt_t *pkt;
+    uint32_t idx = mlvpn_pkt_pool_pop();
+    if (idx == PKT_POOL_NIL) {
+        /* Should not happen as long as pool users reserve what they hold */
+        log_warnx("buffer", "packet pool exhausted (%u packets), growing",
+            pkt_pool.size);
+        mlvpn_pkt_pool_grow(PKT_POOL_CHUNK);
+        idx = mlvpn_pkt_pool_pop();
+    }
+    __atomic_add_fetch(&pkt_pool.in_use, 1, __ATOMIC_RELAXED);
+    pkt = pkt_pool.slots[idx];
+    pkt->len = 0;
+    pkt->type = MLVPN_PKT_DATA;
+    pkt->reorder = 0;
+    pkt->duplicate = 0;
+    pkt->seq = 0;
+    return pkt;
+}
+
+void
+mlvpn_pkt_release(mlvpn_pkt_t *pkt)
+{
+    __atomic_sub_fetch(&pkt_pool.in_use, 1, __ATOMIC_RELAXED);
+    mlvpn_pkt_pool_push(pkt->pool_idx);
+}
+
 /**
  * Application specific handlers
+ * pktbuffers only hold pointers to packets of the pool.
  */
 circular_buffer_t *
 mlvpn_pktbuffer_init(int size)
 {
-    int i;
     /* Basic circular buffer allocation */
     circular_buffer_t *buf = mlvpn_cb_init(size);
 
-    /* Actual packet buffer memory allocation */
+    mlvpn_pkt_pool_reserve(size);
     pktbuffer_t *pktbuf = calloc(1, sizeof(pktbuffer_t));
-    pktbuf->pkts = malloc(buf->size * sizeof(mlvpn_pkt_t *));
-    for(i = 0; i < buf->size; i++)
-        pktbuf->pkts[i] = calloc(1, sizeof(mlvpn_pkt_t));
+    pktbuf->pkts = calloc(buf->size, sizeof(mlvpn_pkt_t *));
+    if (pktbuf->pkts == NULL)
+        fatal("buffer", "memory allocation failed");
 
     buf->data = pktbuf;
-    /* This is sub-optimal as we call cb_free another time.
-     * Not a big deal though. */
-    mlvpn_pktbuffer_reset(buf);
     return buf;
 }
 
@@ -120,34 +270,72 @@ void
 mlvpn_pktbuffer_free(circular_buffer_t *buf)
 {
     pktbuffer_t *pktbuffer = buf->data;
+    mlvpn_pktbuffer_reset(buf);
+    mlvpn_pkt_pool_unreserve(buf->size - 1);
     free(pktbuffer->pkts);
+    free(pktbuffer);
     mlvpn_cb_free(buf);
 }
 
+/* Release every queued packet to the pool */
 void
 mlvpn_pktbuffer_reset(circular_buffer_t *buf)
 {
+    pktbuffer_t *pktbuffer = buf->data;
+    while (! mlvpn_cb_is_empty(buf))
+        mlvpn_pkt_release(mlvpn_pktbuffer_read(buf));
     mlvpn_cb_reset(buf);
+    pktbuffer->bytes = 0;
 }
 
+/* Queue pkt. When the buffer is full, the oldest packet is dropped. */
+void
+mlvpn_pktbuffer_push(circular_buffer_t *buf, mlvpn_pkt_t *pkt)
+{
+    pktbuffer_t *pktbuffer = buf->data;
+    if (mlvpn_cb_is_full(buf))
+        mlvpn_pkt_release(mlvpn_pktbuffer_read(buf));
+    pktbuffer->pkts[buf->end] = pkt;
+    pktbuffer->bytes += pkt->len;
+    mlvpn_cb_write(buf, (void *)pktbuffer->pkts);
+}
+
+/* Queue and return a new packet from the pool */
 mlvpn_pkt_t *
 mlvpn_pktbuffer_write(circular_buffer_t *buf)
 {
-    pktbuffer_t *pktbuffer = buf->data;
-    mlvpn_pkt_t *pkt = (mlvpn_pkt_t *)mlvpn_cb_write(buf,
-                       (void *)pktbuffer->pkts);
-    /* Initialize the new packet to send */
-    pkt->len = 0;
-    pkt->type = MLVPN_PKT_DATA;
+    mlvpn_pkt_t *pkt = mlvpn_pkt_alloc();
+    mlvpn_pktbuffer_push(buf, pkt);
     return pkt;
 }
 
+/* Dequeue a packet. The caller must release it when done. */
 mlvpn_pkt_t *
 mlvpn_pktbuffer_read(circular_buffer_t *buf)
 {
     pktbuffer_t *pktbuffer = buf->data;
-    return (mlvpn_pkt_t *)mlvpn_cb_read(buf,
-                                        (void *)pktbuffer->pkts);
+    mlvpn_pkt_t *pkt = (mlvpn_pkt_t *)mlvpn_cb_read(buf,
+                                                    (void *)pktbuffer->pkts);
+    /* packets queued before their length was set count as empty */
+    pktbuffer->bytes -= MIN(pkt->len, pktbuffer->bytes);
+    return pkt;
+}
+
+/* Oldest packet queued, left in the buffer */
+mlvpn_pkt_t *
+mlvpn_pktbuffer_read_norelease(circular_buffer_t *buf)
+{
+    pktbuffer_t *pktbuffer = buf->data;
+    return (mlvpn_pkt_t *)mlvpn_cb_read_norelease(buf,
+                                                  (void *)pktbuffer->pkts);
+}
+
+/* Bytes of data queued */
+uint32_t
+mlvpn_pktbuffer_bytes(circular_buffer_t *buf)
+{
+    pktbuffer_t *pktbuffer = buf->data;
+    return pktbuffer->bytes;
 }
 
 
@@ -155,25 +343,39 @@ freebuffer_t *
 mlvpn_freebuffer_init(unsigned int size)
 {
     unsigned int i;
-    struct pkt_entry *entry;
-    freebuffer_t *freebuf = calloc(size, sizeof(freebuffer_t));
+    freebuffer_t *freebuf = calloc(1, sizeof(freebuffer_t));
     if (freebuf == NULL) {
         fatal("buffer", "memory allocation failed");
     }
+    /* every entry in one allocation */
+    freebuf->entries = calloc(size, sizeof(struct pkt_entry));
+    if (freebuf->entries == NULL) {
+        fatal("buffer", "memory allocation failed");
+    }
     freebuf->size = size;
     freebuf->used = 0;
     TAILQ_INIT(&freebuf->free_head);
     TAILQ_INIT(&freebuf->used_head);
     for(i = 0; i < size; i++) {
-        entry = calloc(1, sizeof(struct pkt_entry));
-        if (entry == NULL) {
-            fatal("buffer", "memory allocation failed");
-        }
-        TAILQ_INSERT_HEAD(&freebuf->free_head, entry, entries);
+        TAILQ_INSERT_TAIL(&freebuf->free_head, &freebuf->entries[i], entries);
     }
+    /* the packets held are taken from the pool */
+    mlvpn_pkt_pool_reserve(size);
     return freebuf;
 }
 
+/* Release the freebuffer and its pool reservation. The packets still
+ * held must have been drained. */
+void
+mlvpn_freebuffer_destroy(freebuffer_t *freebuf)
+{
+    if (freebuf == NULL)
+        return;
+    mlvpn_pkt_pool_unreserve(freebuf->size);
+    free(freebuf->entries);
+    free(freebuf);
+}
+
 void
 mlvpn_freebuffer_reset(freebuffer_t *freebuf) 
 {
@@ -182,21 +384,25 @@ mlvpn_freebuffer_reset(freebuffer_t *freebuf)
         entry = TAILQ_FIRST(&freebuf->used_head);
         TAILQ_REMOVE(&freebuf->used_head, entry, entries);
         TAILQ_INSERT_HEAD(&freebuf->free_head, entry, entries);
+        entry->pkt = NULL;
     }
     freebuf->used = 0;
 }
 
-mlvpn_pkt_t *
-mlvpn_freebuffer_get(freebuffer_t *freebuf)
+/* Account for pkt being held. Returns -1 when the freebuffer is full. */
+int
+mlvpn_freebuffer_put(freebuffer_t *freebuf, mlvpn_pkt_t *pkt)
 {
     struct pkt_entry *entry = TAILQ_FIRST(&freebuf->free_head);
     if (entry) {
         TAILQ_REMOVE(&freebuf->free_head, entry, entries);
         TAILQ_INSERT_TAIL(&freebuf->used_head, entry, entries);
+        entry->pkt = pkt;
+        pkt->hold_idx = entry - freebuf->entries;
         freebuf->used++;
-        return &entry->pkt;
+        return 0;
     } else {
-        return NULL;
+        return -1;
     }
 }
 
@@ -205,30 +411,31 @@ mlvpn_freebuffer_drain_used(freebuffer_t *freebuf)
 {
     /* We get the elements in reverse order there... Not ideal */
     struct pkt_entry *entry = TAILQ_FIRST(&freebuf->used_head);
+    mlvpn_pkt_t *pkt;
     if (entry) {
         TAILQ_REMOVE(&freebuf->used_head, entry, entries);
         TAILQ_INSERT_HEAD(&freebuf->free_head, entry, entries);
         freebuf->used--;
-        return &entry->pkt;
+        pkt = entry->pkt;
+        entry->pkt = NULL;
+        return pkt;
     } else {
         return NULL;
     }
 }
 
+/* The packet carries the index of its entry: no need to search for it */
 void
 mlvpn_freebuffer_free(freebuffer_t *freebuf, mlvpn_pkt_t *pkt)
 {
     struct pkt_entry *entry;
-    mlvpn_pkt_t *p;
-    TAILQ_FOREACH(entry, &freebuf->used_head, entries)
-    {
-        p = &entry->pkt;
-        if (p == pkt) {
-            TAILQ_REMOVE(&freebuf->used_head, entry, entries);
-            TAILQ_INSERT_HEAD(&freebuf->free_head, entry, entries);
-            freebuf->used--;
-            return;
-        }
-    }
-    fatalx("freebuffer_free could not find the packet you gave me.");
+    if (pkt->hold_idx >= freebuf->size)
+        fatalx("freebuffer_free could not find the packet you gave me.");
+    entry = &freebuf->entries[pkt->hold_idx];
+    if (entry->pkt != pkt)
+        fatalx("freebuffer_free could not find the packet you gave me.");
+    TAILQ_REMOVE(&freebuf->used_head, entry, entries);
+    TAILQ_INSERT_HEAD(&freebuf->free_head, entry, entries);
+    entry->pkt = NULL;
+    freebuf->used--;
 }
\ No newline at end of file
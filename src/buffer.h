@@ -20,17 +20,19 @@ typedef struct
 typedef struct
 {
     mlvpn_pkt_t **pkts;
+    uint32_t bytes;     /* sum of the queued packets length */
 } pktbuffer_t;
 
 
 struct pkt_entry {
-    mlvpn_pkt_t pkt;
+    mlvpn_pkt_t *pkt;
     TAILQ_ENTRY(pkt_entry) entries;
 };
 
 typedef struct {
     uint32_t size;
     uint32_t used;
+    struct pkt_entry *entries;
     TAILQ_HEAD(, pkt_entry) free_head;
     TAILQ_HEAD(, pkt_entry) used_head;
 } freebuffer_t;
@@ -55,6 +57,9 @@ mlvpn_cb_is_full(const circular_buffer_t *buf);
 int
 mlvpn_cb_is_empty(const circular_buffer_t *buf);
 
+int
+mlvpn_cb_count(const circular_buffer_t *buf);
+
 void *
 mlvpn_cb_read(circular_buffer_t *buf, void **data);
 
@@ -64,6 +69,29 @@ mlvpn_cb_read_norelease(const circular_buffer_t *buf, void **data);
 void *
 mlvpn_cb_write(circular_buffer_t *buf, void **data);
 
+/**
+ * Packet pool
+ * Packets move by pointer between the tuntap device and the circular
+ * buffers. Whoever reads a packet from a pktbuffer owns it and must
+ * give it back with mlvpn_pkt_release().
+ * Every holder of packets reserves its maximum occupancy, which sizes
+ * the pool.
+ */
+void
+mlvpn_pkt_pool_prealloc(uint32_t size);
+
+void
+mlvpn_pkt_pool_reserve(uint32_t count);
+
+void
+mlvpn_pkt_pool_unreserve(uint32_t count);
+
+mlvpn_pkt_t *
+mlvpn_pkt_alloc();
+
+void
+mlvpn_pkt_release(mlvpn_pkt_t *pkt);
+
 /**
  * Application specific cirtular buffer handlers
  */
@@ -80,24 +108,33 @@ mlvpn_pktbuffer_reset(circular_buffer_t *buf);
 mlvpn_pkt_t *
 mlvpn_pktbuffer_read(circular_buffer_t *buf);
 
+uint32_t
+mlvpn_pktbuffer_bytes(circular_buffer_t *buf);
+
 mlvpn_pkt_t *
 mlvpn_pktbuffer_read_norelease(circular_buffer_t *buf);
 
 mlvpn_pkt_t *
 mlvpn_pktbuffer_write(circular_buffer_t *buf);
 
+void
+mlvpn_pktbuffer_push(circular_buffer_t *buf, mlvpn_pkt_t *pkt);
+
 
 /**
- * Single allocation buffers (used for reordering)
+ * Pool packets held by the reorder buffer
  */
 freebuffer_t *
 mlvpn_freebuffer_init(uint32_t size);
 
+void
+mlvpn_freebuffer_destroy(freebuffer_t *freebuf);
+
 void
 mlvpn_freebuffer_reset(freebuffer_t *freebuf);
 
-mlvpn_pkt_t *
-mlvpn_freebuffer_get(freebuffer_t *freebuf);
+int
+mlvpn_freebuffer_put(freebuffer_t *freebuf, mlvpn_pkt_t *pkt);
 
 void
 mlvpn_freebuffer_free(freebuffer_t *freebuf, mlvpn_pkt_t *pkt);
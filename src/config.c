@@ -35,7 +35,6 @@ extern char *status_command;
 extern struct mlvpn_options_s mlvpn_options;
 extern struct mlvpn_filters_s mlvpn_filters;
 extern struct tuntap_s tuntap;
-extern struct mlvpn_reorder_buffer *reorder_buffer;
 
 char *ip_from_if(char *ifname);
 // we'll declair this here, so that any device name used instead of an IP
@@ -60,10 +59,26 @@ mlvpn_config(int config_file_fd, int first_time)
 
     uint32_t default_loss_tolerence = 100;
     uint32_t default_timeout = 60;
+    uint32_t default_recv_batch = 1;
+    uint32_t default_send_batch = 1;
+    uint32_t default_udp_offload = 0;
+    uint32_t default_probe_interval = MLVPN_PROBE_INTERVAL;
+    uint32_t default_congestion_target = MLVPN_CC_TARGET;
+    uint32_t default_pacing = 0;
+    uint32_t default_bundle = 0;
+    uint32_t default_bundle_delay = 0;
+    uint32_t default_liveness_interval = 0;
+    uint32_t default_liveness_misses = MLVPN_LIVENESS_MISSES;
+    uint32_t tuntap_queues = 1;
+    uint32_t tuntap_read_budget = MLVPN_TUNTAP_READ_BUDGET;
+    uint32_t packet_pool_size = 0;
     uint32_t default_server_mode = 0; /* 0 => client */
     uint32_t cleartext_data = 0;
     uint32_t fallback_only = 0;
     uint32_t reorder_buffer_size = 0;
+    uint32_t fec = 0;
+    uint32_t retransmit_budget = 0;
+    uint32_t duplicate_dscp = 0;
 
     mlvpn_options.fallback_available = 0;
 
@@ -107,6 +122,24 @@ mlvpn_config(int config_file_fd, int first_time)
                             tuntap.type = MLVPN_TUNTAPMODE_TAP;
                         free(tmp);
                     }
+                    _conf_set_uint_from_conf(
+                        config, lastSection, "tuntap_queues", &tuntap_queues, 1,
+                        NULL, 0);
+                    if (tuntap_queues == 0) {
+                        tuntap_queues = 1;
+                    } else if (tuntap_queues > MLVPN_TUNTAP_MAXQUEUES) {
+                        log_warnx("config", "tuntap_queues capped to %d",
+                            MLVPN_TUNTAP_MAXQUEUES);
+                        tuntap_queues = MLVPN_TUNTAP_MAXQUEUES;
+                    }
+#ifndef HAVE_LINUX
+                    if (tuntap_queues > 1) {
+                        log_warnx("config", "tuntap_queues is only available "
+                            "on Linux");
+                        tuntap_queues = 1;
+                    }
+#endif
+                    tuntap.queues = tuntap_queues;
                     /* Control configuration */
                     _conf_set_str_from_conf(
                         config, lastSection, "control_unix_path", &tmp, NULL,
@@ -167,6 +200,79 @@ mlvpn_config(int config_file_fd, int first_time)
                     default_timeout = 5;
                 }
 
+                _conf_set_uint_from_conf(
+                    config, lastSection, "recv_batch", &default_recv_batch, 1,
+                    NULL, 0);
+                _conf_set_uint_from_conf(
+                    config, lastSection, "send_batch", &default_send_batch, 1,
+                    NULL, 0);
+                _conf_set_uint_from_conf(
+                    config, lastSection, "udp_offload", &default_udp_offload, 0,
+                    NULL, 0);
+                _conf_set_uint_from_conf(
+                    config, lastSection, "probe_interval",
+                    &default_probe_interval, MLVPN_PROBE_INTERVAL, NULL, 0);
+                _conf_set_uint_from_conf(
+                    config, lastSection, "congestion_target",
+                    &default_congestion_target, MLVPN_CC_TARGET, NULL, 0);
+                _conf_set_uint_from_conf(
+                    config, lastSection, "pacing", &default_pacing, 0,
+                    NULL, 0);
+                _conf_set_uint_from_conf(
+                    config, lastSection, "bundle", &default_bundle, 0,
+                    NULL, 0);
+                _conf_set_uint_from_conf(
+                    config, lastSection, "bundle_delay",
+                    &default_bundle_delay, 0, NULL, 0);
+                _conf_set_uint_from_conf(
+                    config, lastSection, "liveness_interval",
+                    &default_liveness_interval, 0, NULL, 0);
+                _conf_set_uint_from_conf(
+                    config, lastSection, "liveness_misses",
+                    &default_liveness_misses, MLVPN_LIVENESS_MISSES, NULL, 0);
+
+                _conf_set_str_from_conf(
+                    config, lastSection, "scheduler", &tmp, "wrr", NULL, 0);
+                if (tmp) {
+                    enum mlvpn_scheduler scheduler = MLVPN_SCHED_WRR;
+                    if (mystr_eq(tmp, "earliest"))
+                        scheduler = MLVPN_SCHED_EARLIEST;
+                    else if (! mystr_eq(tmp, "wrr"))
+                        log_warnx("config", "unknown scheduler \"%s\", "
+                            "using wrr", tmp);
+                    if (scheduler != mlvpn_options.scheduler) {
+                        log_info("config", "scheduler changed to %s",
+                            scheduler == MLVPN_SCHED_EARLIEST ?
+                            "earliest" : "wrr");
+                        mlvpn_options.scheduler = scheduler;
+                    }
+                    free(tmp);
+                }
+
+                _conf_set_uint_from_conf(
+                    config, lastSection, "tuntap_read_budget",
+                    &tuntap_read_budget, MLVPN_TUNTAP_READ_BUDGET, NULL, 0);
+                if (tuntap_read_budget == 0) {
+                    tuntap_read_budget = 1;
+                } else if (tuntap_read_budget > PKTBUFSIZE) {
+                    log_warnx("config", "tuntap_read_budget capped to %d",
+                        PKTBUFSIZE);
+                    tuntap_read_budget = PKTBUFSIZE;
+                }
+                if (tuntap_read_budget != tuntap.read_budget) {
+                    log_info("config",
+                        "tuntap_read_budget changed from %d to %d",
+                        tuntap.read_budget, tuntap_read_budget);
+                    tuntap.read_budget = tuntap_read_budget;
+                }
+
+                /* The pool only grows: a smaller value on reload
+                 * keeps the packets already allocated. */
+                _conf_set_uint_from_conf(
+                    config, lastSection, "packet_pool_size",
+                    &packet_pool_size, 0, NULL, 0);
+                mlvpn_pkt_pool_prealloc(packet_pool_size);
+
                 _conf_set_uint_from_conf(
                     config, lastSection, "reorder_buffer_size",
                     &reorder_buffer_size,
@@ -176,22 +282,55 @@ mlvpn_config(int config_file_fd, int first_time)
                         "reorder_buffer_size changed from %d to %d",
                         mlvpn_options.reorder_buffer_size,
                         reorder_buffer_size);
-                    if (reorder_buffer_size != 0 &&
-                            mlvpn_options.reorder_buffer_size != 0) {
-                        mlvpn_reorder_free(reorder_buffer);
-                        reorder_buffer = NULL;
-                    }
                     mlvpn_options.reorder_buffer_size = reorder_buffer_size;
-                    if (mlvpn_options.reorder_buffer_size > 0) {
-                        if (reorder_buffer) {
-                            mlvpn_reorder_free(reorder_buffer);
-                        }
-                        reorder_buffer = mlvpn_reorder_create(
-                            mlvpn_options.reorder_buffer_size);
-                        if (reorder_buffer == NULL) {
-                            fatal("config", "reorder_buffer allocation failed");
-                        }
-                    }
+                    mlvpn_rtun_reorder_resize(reorder_buffer_size);
+                }
+
+                _conf_set_uint_from_conf(
+                    config, lastSection, "fec", &fec, 0, NULL, 0);
+                if (fec == 1)
+                    fec = MLVPN_FEC_GROUP_MIN;
+                if (fec > MLVPN_FEC_GROUP_MAX) {
+                    log_warnx("config", "fec is capped to %d",
+                        MLVPN_FEC_GROUP_MAX);
+                    fec = MLVPN_FEC_GROUP_MAX;
+                }
+                if (fec != mlvpn_options.fec) {
+                    log_info("config", "fec changed from %d to %d",
+                        mlvpn_options.fec, fec);
+                    mlvpn_options.fec = fec;
+                    mlvpn_fec_update(0);
+                }
+
+                _conf_set_uint_from_conf(
+                    config, lastSection, "retransmit_budget",
+                    &retransmit_budget, 0, NULL, 0);
+                if (retransmit_budget > MLVPN_REORDER_HOLD_MAX) {
+                    log_warnx("config", "retransmit_budget is capped to %dms",
+                        (int)MLVPN_REORDER_HOLD_MAX);
+                    retransmit_budget = MLVPN_REORDER_HOLD_MAX;
+                }
+                if (retransmit_budget != mlvpn_options.retransmit_budget) {
+                    log_info("config", "retransmit_budget changed from %d to %d",
+                        mlvpn_options.retransmit_budget, retransmit_budget);
+                    mlvpn_options.retransmit_budget = retransmit_budget;
+                    if (retransmit_budget)
+                        mlvpn_nack_init();
+                    mlvpn_nack_reset();
+                }
+
+                _conf_set_uint_from_conf(
+                    config, lastSection, "duplicate_dscp",
+                    &duplicate_dscp, 0, NULL, 0);
+                if (duplicate_dscp > 63) {
+                    log_warnx("config", "invalid duplicate_dscp %d",
+                        duplicate_dscp);
+                    duplicate_dscp = 0;
+                }
+                if (duplicate_dscp != mlvpn_options.duplicate_dscp) {
+                    log_info("config", "duplicate_dscp changed from %d to %d",
+                        mlvpn_options.duplicate_dscp, duplicate_dscp);
+                    mlvpn_options.duplicate_dscp = duplicate_dscp;
                 }
 
                 _conf_set_uint_from_conf(
@@ -280,8 +419,19 @@ mlvpn_config(int config_file_fd, int first_time)
                 char *dstport;
                 uint32_t bwlimit = 0;
                 uint32_t quota = 0;
+                uint32_t quota_burst = 0;
                 uint32_t timeout = 30;
                 uint32_t loss_tolerence;
+                uint32_t recv_batch;
+                uint32_t send_batch;
+                uint32_t udp_offload;
+                uint32_t probe_interval;
+                uint32_t congestion_target;
+                uint32_t pacing;
+                uint32_t bundle;
+                uint32_t bundle_delay;
+                uint32_t liveness_interval;
+                uint32_t liveness_misses;
                 int create_tunnel = 1;
 
                 if (default_server_mode)
@@ -328,6 +478,9 @@ mlvpn_config(int config_file_fd, int first_time)
                 _conf_set_uint_from_conf(
                     config, lastSection, "quota", &quota, 0,
                     NULL, 0);
+                _conf_set_uint_from_conf(
+                    config, lastSection, "quota_burst", &quota_burst, 0,
+                    NULL, 0);
                 _conf_set_uint_from_conf(
                     config, lastSection, "timeout", &timeout, default_timeout,
                     NULL, 0);
@@ -342,6 +495,86 @@ mlvpn_config(int config_file_fd, int first_time)
                     log_warnx("config", "loss_tolerence is capped to 100 %%");
                     loss_tolerence = 100;
                 }
+                _conf_set_uint_from_conf(
+                    config, lastSection, "recv_batch", &recv_batch,
+                    default_recv_batch, NULL, 0);
+                if (recv_batch == 0) {
+                    recv_batch = 1;
+                } else if (recv_batch > MLVPN_BATCH_MAX) {
+                    log_warnx("config", "recv_batch capped to %d",
+                        MLVPN_BATCH_MAX);
+                    recv_batch = MLVPN_BATCH_MAX;
+                }
+#ifndef HAVE_RECVMMSG
+                if (recv_batch > 1) {
+                    log_warnx("config", "%s recv_batch requires recvmmsg, "
+                        "which is not available on this system", lastSection);
+                    recv_batch = 1;
+                }
+#endif
+                _conf_set_uint_from_conf(
+                    config, lastSection, "send_batch", &send_batch,
+                    default_send_batch, NULL, 0);
+                if (send_batch == 0) {
+                    send_batch = 1;
+                } else if (send_batch > MLVPN_BATCH_MAX) {
+                    log_warnx("config", "send_batch capped to %d",
+                        MLVPN_BATCH_MAX);
+                    send_batch = MLVPN_BATCH_MAX;
+                }
+#ifndef HAVE_SENDMMSG
+                if (send_batch > 1) {
+                    log_warnx("config", "%s send_batch requires sendmmsg, "
+                        "which is not available on this system", lastSection);
+                    send_batch = 1;
+                }
+#endif
+                _conf_set_uint_from_conf(
+                    config, lastSection, "udp_offload", &udp_offload,
+                    default_udp_offload, NULL, 0);
+                udp_offload = udp_offload ? 1 : 0;
+#ifndef HAVE_LINUX
+                if (udp_offload) {
+                    log_warnx("config", "%s udp_offload is only available "
+                        "on Linux", lastSection);
+                    udp_offload = 0;
+                }
+#endif
+                _conf_set_uint_from_conf(
+                    config, lastSection, "probe_interval", &probe_interval,
+                    default_probe_interval, NULL, 0);
+                _conf_set_uint_from_conf(
+                    config, lastSection, "congestion_target",
+                    &congestion_target, default_congestion_target, NULL, 0);
+                _conf_set_uint_from_conf(
+                    config, lastSection, "pacing", &pacing, default_pacing,
+                    NULL, 0);
+                pacing = pacing ? 1 : 0;
+                _conf_set_uint_from_conf(
+                    config, lastSection, "bundle", &bundle, default_bundle,
+                    NULL, 0);
+                bundle = bundle ? 1 : 0;
+                _conf_set_uint_from_conf(
+                    config, lastSection, "bundle_delay", &bundle_delay,
+                    default_bundle_delay, NULL, 0);
+                if (bundle_delay > MLVPN_BUNDLE_DELAY_MAX) {
+                    log_warnx("config", "%s bundle_delay capped to %dms",
+                        lastSection, MLVPN_BUNDLE_DELAY_MAX);
+                    bundle_delay = MLVPN_BUNDLE_DELAY_MAX;
+                }
+                _conf_set_uint_from_conf(
+                    config, lastSection, "liveness_interval",
+                    &liveness_interval, default_liveness_interval, NULL, 0);
+                if (liveness_interval && liveness_interval < 10) {
+                    log_warnx("config", "%s liveness_interval too short, "
+                        "using 10ms", lastSection);
+                    liveness_interval = 10;
+                }
+                _conf_set_uint_from_conf(
+                    config, lastSection, "liveness_misses", &liveness_misses,
+                    default_liveness_misses, NULL, 0);
+                if (liveness_misses == 0)
+                    liveness_misses = 1;
                 _conf_set_uint_from_conf(
                     config, lastSection, "fallback_only", &fallback_only, 0,
                     NULL, 0);
@@ -395,6 +628,13 @@ mlvpn_config(int config_file_fd, int first_time)
                           log_info("config", "%s quota changed from %d to %d",
                                 tmptun->name, tmptun->quota, quota);
                             tmptun->quota = quota;
+                            mlvpn_rtun_wrr_unblock(tmptun);
+                        }
+                        if (tmptun->quota_burst != quota_burst)
+                        {
+                          log_info("config", "%s quota_burst changed from %d to %d",
+                                tmptun->name, tmptun->quota_burst, quota_burst);
+                            tmptun->quota_burst = quota_burst;
                         }
                         if (tmptun->loss_tolerence != loss_tolerence)
                         {
@@ -402,6 +642,64 @@ mlvpn_config(int config_file_fd, int first_time)
                                 tmptun->name, tmptun->loss_tolerence, loss_tolerence);
                             tmptun->loss_tolerence = loss_tolerence;
                         }
+                        if (tmptun->recv_batch != recv_batch)
+                        {
+                            log_info("config", "%s recv_batch changed from %d to %d",
+                                tmptun->name, tmptun->recv_batch, recv_batch);
+                            tmptun->recv_batch = recv_batch;
+                        }
+                        if (tmptun->send_batch != send_batch)
+                        {
+                            log_info("config", "%s send_batch changed from %d to %d",
+                                tmptun->name, tmptun->send_batch, send_batch);
+                            tmptun->send_batch = send_batch;
+                        }
+                        if (tmptun->udp_offload != udp_offload)
+                        {
+                            log_info("config", "%s udp_offload changed from %d to %d",
+                                tmptun->name, tmptun->udp_offload, udp_offload);
+                            tmptun->udp_offload = udp_offload;
+                            mlvpn_rtun_set_offload(tmptun);
+                        }
+                        if (tmptun->probe_interval != probe_interval)
+                        {
+                            log_info("config", "%s probe_interval changed from %d to %d",
+                                tmptun->name, tmptun->probe_interval, probe_interval);
+                            tmptun->probe_interval = probe_interval;
+                            tmptun->next_probe = 0;
+                        }
+                        if (tmptun->cc_target != congestion_target)
+                        {
+                            log_info("config", "%s congestion_target changed from %d to %d",
+                                tmptun->name, tmptun->cc_target, congestion_target);
+                            tmptun->cc_target = congestion_target;
+                        }
+                        if (tmptun->pacing != pacing)
+                        {
+                            log_info("config", "%s pacing changed from %d to %d",
+                                tmptun->name, tmptun->pacing, pacing);
+                            tmptun->pacing = pacing;
+                        }
+                        if (tmptun->bundle != bundle ||
+                            tmptun->bundle_delay != bundle_delay)
+                        {
+                            log_info("config", "%s bundle changed from %d (%dms) to %d (%dms)",
+                                tmptun->name, tmptun->bundle,
+                                tmptun->bundle_delay, bundle, bundle_delay);
+                            tmptun->bundle = bundle;
+                            tmptun->bundle_delay = bundle_delay;
+                        }
+                        if (tmptun->liveness_interval != liveness_interval ||
+                            tmptun->liveness_misses != liveness_misses)
+                        {
+                            log_info("config", "%s liveness changed from %dms x%d to %dms x%d",
+                                tmptun->name, tmptun->liveness_interval,
+                                tmptun->liveness_misses, liveness_interval,
+                                liveness_misses);
+                            tmptun->liveness_interval = liveness_interval;
+                            tmptun->liveness_misses = liveness_misses;
+                            mlvpn_rtun_set_liveness(tmptun);
+                        }
                         create_tunnel = 0;
                         break; /* Very important ! */
                     }
@@ -410,10 +708,23 @@ mlvpn_config(int config_file_fd, int first_time)
                 if (create_tunnel)
                 {
                     log_info("config", "%s tunnel added", lastSection);
-                    mlvpn_rtun_new(
+                    tmptun = mlvpn_rtun_new(
                         lastSection, bindaddr, bindport, bindfib, dstaddr, dstport,
                         default_server_mode, timeout, fallback_only,
                         bwlimit, loss_tolerence, quota);
+                    if (tmptun) {
+                        tmptun->recv_batch = recv_batch;
+                        tmptun->send_batch = send_batch;
+                        tmptun->udp_offload = udp_offload;
+                        tmptun->quota_burst = quota_burst;
+                        tmptun->probe_interval = probe_interval;
+                        tmptun->cc_target = congestion_target;
+                        tmptun->pacing = pacing;
+                        tmptun->bundle = bundle;
+                        tmptun->bundle_delay = bundle_delay;
+                        tmptun->liveness_interval = liveness_interval;
+                        tmptun->liveness_misses = liveness_misses;
+                    }
                 }
                 if (bindaddr)
                     free(bindaddr);
@@ -483,6 +794,18 @@ mlvpn_config(int config_file_fd, int first_time)
                         }
                     }
                 }
+                if (!found_in_config &&
+                        strcmp(work->conf->var, "duplicate") == 0) {
+                    /* not a tunnel: packets sent on two tunnels */
+                    if (mlvpn_filters_add(&filter, NULL) != 0) {
+                        log_warnx("config", "duplicate filter %s error: "
+                            "too many filters", work->conf->val);
+                    } else {
+                        log_debug("config", "added duplicate filter: %s",
+                            work->conf->val);
+                        found_in_config = 1;
+                    }
+                }
                 if (!found_in_config) {
                     log_warnx("config", "(filters) %s interface not found",
                         work->conf->var);
@@ -26,10 +26,12 @@
 #include "mlvpn.h"
 #include "control.h"
 #include "tuntap_generic.h"
+#include "reorder.h"
 
 extern struct tuntap_s tuntap;
 extern char *_progname;
 extern struct mlvpn_status_s mlvpn_status;
+extern struct mlvpn_reorder_buffer *reorder_buffer;
 void mlvpn_control_write_status(struct mlvpn_control *ctrl);
 
 
@@ -51,6 +53,33 @@ void mlvpn_control_write_status(struct mlvpn_control *ctrl);
     "   \"type\": \"%s\",\n" \
     "   \"name\": \"%s\"\n" \
     "},\n" \
+    "\"reorder\": {\n" \
+    "   \"size\": %u,\n" \
+    "   \"depth\": %u,\n" \
+    "   \"hold\": %u,\n" \
+    "   \"delay_spread\": %u,\n" \
+    "   \"rate\": %u\n" \
+    "},\n" \
+    "\"send_rate\": %u,\n" \
+    "\"recv_rate\": %u,\n" \
+    "\"fec\": {\n" \
+    "   \"group\": %u,\n" \
+    "   \"rebuilt\": %" PRIu64 ",\n" \
+    "   \"duplicates\": %" PRIu64 "\n" \
+    "},\n" \
+    "\"retransmit\": {\n" \
+    "   \"wait\": %u,\n" \
+    "   \"deadline\": %u,\n" \
+    "   \"requested\": %" PRIu64 ",\n" \
+    "   \"received\": %" PRIu64 ",\n" \
+    "   \"sent\": %" PRIu64 "\n" \
+    "},\n" \
+    "\"duplicate\": {\n" \
+    "   \"sent\": %" PRIu64 ",\n" \
+    "   \"bytes\": %" PRIu64 ",\n" \
+    "   \"received\": %" PRIu64 ",\n" \
+    "   \"useful\": %" PRIu64 "\n" \
+    "},\n" \
     "\"tunnels\": [\n"
 
 #define JSON_STATUS_RTUN "{\n" \
@@ -66,9 +95,20 @@ void mlvpn_control_write_status(struct mlvpn_control *ctrl);
     "   \"sentbytes\": %" PRIu64 ",\n" \
     "   \"recvbytes\": %" PRIu64 ",\n" \
     "   \"bandwidth\": %u,\n" \
+    "   \"send_rate\": %u,\n" \
+    "   \"recv_rate\": %u,\n" \
     "   \"srtt\": %u,\n" \
+    "   \"delay\": %u,\n" \
+    "   \"qdelay\": %u,\n" \
+    "   \"cc_rate\": %u,\n" \
+    "   \"pacing_rate\": %u,\n" \
+    "   \"paced\": %" PRIu64 ",\n" \
+    "   \"bundled\": %" PRIu64 ",\n" \
+    "   \"protocol\": %u,\n" \
+    "   \"queued\": %d,\n" \
     "   \"loss\": %u,\n" \
     "   \"permitted\": %u,\n" \
+    "   \"tokens\": %" PRId64 ",\n" \
     "   \"disconnects\": %u,\n" \
     "   \"last_packet\": %u,\n" \
     "   \"timeout\": %u,\n" \
@@ -385,18 +425,37 @@ mlvpn_control_parse(struct mlvpn_control *ctrl, char *line)
 
 void mlvpn_control_write_status(struct mlvpn_control *ctrl)
 {
-    char buf[1024];
+    char buf[2048];
     size_t ret;
     mlvpn_tunnel_t *t;
 
-    ret = snprintf(buf, 1024, JSON_STATUS_BASE,
+    ret = snprintf(buf, sizeof(buf), JSON_STATUS_BASE,
         _progname,
         1, 1, /* TODO */
         (uint32_t) mlvpn_status.start_time,
         (uint32_t) mlvpn_status.last_reload,
         0,
         tuntap.type == MLVPN_TUNTAPMODE_TUN ? "tun" : "tap",
-        tuntap.devname
+        tuntap.devname,
+        reorder_buffer ? mlvpn_reorder_size(reorder_buffer) : 0,
+        mlvpn_status.reorder_depth,
+        (uint32_t)mlvpn_status.reorder_hold,
+        (uint32_t)mlvpn_status.reorder_spread,
+        (uint32_t)mlvpn_status.reorder_rate,
+        (uint32_t)mlvpn_status.send_rate,
+        (uint32_t)mlvpn_status.recv_rate,
+        mlvpn_status.fec_group,
+        mlvpn_status.fec_rebuilt,
+        mlvpn_status.fec_duplicates,
+        (uint32_t)mlvpn_status.nack_wait,
+        (uint32_t)mlvpn_status.nack_deadline,
+        mlvpn_status.nack_sent,
+        mlvpn_status.nack_received,
+        mlvpn_status.nack_retransmitted,
+        mlvpn_status.dup_sent,
+        mlvpn_status.dup_bytes,
+        mlvpn_status.dup_received,
+        mlvpn_status.dup_useful
     );
     mlvpn_control_write(ctrl, buf, ret);
     LIST_FOREACH(t, &rtuns, entries)
@@ -415,7 +474,7 @@ void mlvpn_control_write_status(struct mlvpn_control *ctrl)
         else
             status = "unknown";
 
-        ret = snprintf(buf, 1024, JSON_STATUS_RTUN,
+        ret = snprintf(buf, sizeof(buf), JSON_STATUS_RTUN,
                        t->name,
                        mode,
                        t->bindaddr ? t->bindaddr : "any",
@@ -427,10 +486,21 @@ void mlvpn_control_write_status(struct mlvpn_control *ctrl)
                        t->recvpackets,
                        t->sentbytes,
                        t->recvbytes,
-                       0,
+                       mlvpn_rtun_bandwidth(t),
+                       (uint32_t)t->send_rate,
+                       (uint32_t)t->recv_rate,
                        (uint32_t)t->srtt,
+                       (uint32_t)t->owd_rel,
+                       (uint32_t)t->cc_qdelay,
+                       (uint32_t)t->cc_rate,
+                       (uint32_t)t->pace_rate,
+                       t->pace_deferred,
+                       t->bundled,
+                       t->peer_version,
+                       mlvpn_cb_count(t->sbuf),
                        mlvpn_loss_ratio(t),
                        (uint32_t)(t->permitted/1000000),
+                       mlvpn_rtun_tokens(t),
                        t->disconnects,
                        (uint32_t)t->last_activity,
                        (uint32_t)t->timeout,
@@ -0,0 +1,116 @@
+#include <string.h>
+
+#include "mlvpn.h"
+#include "tuntap_generic.h"
+
+extern struct mlvpn_options_s mlvpn_options;
+extern struct mlvpn_status_s mlvpn_status;
+extern struct tuntap_s tuntap;
+
+/* Packet duplication
+ * Latency critical packets (a "duplicate" filter, or the DSCP given by
+ * duplicate_dscp) are sent on the two fastest tunnels with the same
+ * data_seq: the original on the first one, a MLVPN_PKT_DUPLICATE copy on
+ * the second one. The receiver remembers the data_seq seen in a sliding
+ * bitmap, and drops whichever copy comes in last.
+ */
+
+/* data_seq remembered by the receiver (bits) */
+#define DUP_WINDOW 1024
+
+static struct {
+    int started;
+    uint64_t highest;
+    uint64_t seen[DUP_WINDOW / 64];
+} dup_rx;
+
+/* DSCP of an IP packet, or -1 */
+static int
+mlvpn_dup_dscp(const mlvpn_pkt_t *pkt)
+{
+    const unsigned char *p = (const unsigned char *)pkt->data;
+    uint16_t len = pkt->len;
+
+    if (tuntap.type == MLVPN_TUNTAPMODE_TAP) {
+        if (len < 14)
+            return -1;
+        p += 14; /* ethernet header */
+        len -= 14;
+    }
+    if (len >= 20 && (p[0] >> 4) == 4)
+        return p[1] >> 2;
+    if (len >= 40 && (p[0] >> 4) == 6)
+        return (((p[0] & 0x0f) << 4) | (p[1] >> 4)) >> 2;
+    return -1;
+}
+
+/* Does the packet read from the tuntap device need a copy */
+int
+mlvpn_dup_match(mlvpn_pkt_t *pkt)
+{
+    if (mlvpn_options.duplicate_dscp &&
+            mlvpn_dup_dscp(pkt) == (int)mlvpn_options.duplicate_dscp)
+        return 1;
+#ifdef HAVE_FILTERS
+    if (mlvpn_filters_duplicate(pkt->len, (u_char *)pkt->data))
+        return 1;
+#endif
+    return 0;
+}
+
+/* Copy of a data packet for the second tunnel, before its encryption */
+mlvpn_pkt_t *
+mlvpn_dup_copy(mlvpn_pkt_t *pkt, uint64_t seq)
+{
+    mlvpn_pkt_t *copy = mlvpn_pkt_alloc();
+    copy->type = MLVPN_PKT_DUPLICATE;
+    copy->seq = seq;
+    copy->len = pkt->len;
+    memcpy(copy->data, pkt->data, pkt->len);
+    mlvpn_status.dup_sent++;
+    mlvpn_status.dup_bytes += pkt->len;
+    return copy;
+}
+
+void
+mlvpn_dup_reset()
+{
+    memset(&dup_rx, 0, sizeof(dup_rx));
+}
+
+#define DUP_BIT(seq) ((uint64_t)1 << ((seq) % 64))
+#define DUP_WORD(seq) dup_rx.seen[((seq) % DUP_WINDOW) / 64]
+
+/* A data packet was received (dup: the copy of a duplicated packet).
+ * Returns -1 if its data_seq was seen already, 0 otherwise.
+ */
+int
+mlvpn_dup_rx_data(mlvpn_pkt_t *pkt, int dup)
+{
+    uint64_t seq;
+
+    if (dup)
+        mlvpn_status.dup_received++;
+    if (!dup_rx.started) {
+        dup_rx.started = 1;
+        dup_rx.highest = pkt->seq;
+    } else if (pkt->seq + DUP_WINDOW <= dup_rx.highest) {
+        /* older than the bitmap: can't tell, let it through (the state
+         * is reset when the peer restarts, see mlvpn_protocol_read) */
+        return 0;
+    } else if (pkt->seq > dup_rx.highest) {
+        if (pkt->seq - dup_rx.highest >= DUP_WINDOW) {
+            memset(dup_rx.seen, 0, sizeof(dup_rx.seen));
+        } else {
+            for (seq = dup_rx.highest + 1; seq < pkt->seq; seq++)
+                DUP_WORD(seq) &= ~DUP_BIT(seq);
+        }
+        dup_rx.highest = pkt->seq;
+    } else if (DUP_WORD(pkt->seq) & DUP_BIT(pkt->seq)) {
+        return -1;
+    }
+    DUP_WORD(pkt->seq) |= DUP_BIT(pkt->seq);
+    if (dup)
+        mlvpn_status.dup_useful++;
+    return 0;
+}
@@ -0,0 +1,300 @@
+#include "mlvpn.h"
+#include "tuntap_generic.h"
+
+extern struct mlvpn_options_s mlvpn_options;
+extern struct mlvpn_status_s mlvpn_status;
+extern struct tuntap_s tuntap;
+extern struct mlvpn_reorder_buffer *reorder_buffer;
+
+/* Forward error correction
+ * The sender XORs groups of consecutive data packets (by data_seq) into
+ * a parity packet, sent on the tunnel carrying the fewest members of the
+ * group. The receiver keeps a copy of the last data packets received:
+ * once the parity and all the members but one are in, the missing one is
+ * rebuilt without waiting for the reorder drain timeout. The copies also
+ * detect the late arrival of a rebuilt packet, which is dropped.
+ *
+ * Members are padded with zeros to the longest one. Rebuilt IP packets
+ * are trimmed to the length of their IP header.
+ *
+ * Packets of the slow links routinely arrive hundreds of sequence
+ * numbers late: the receive window covers at least the reorder buffer,
+ * and packets older than the window are only left out of the parity
+ * groups. The state is reset when the peer restarts (new flow_id).
+ */
+
+/* Minimum number of data packets remembered by the receiver */
+#define FEC_WINDOW 1024
+/* Parity packets waiting for their members */
+#define FEC_PENDING 16
+
+struct fec_slot {
+    uint64_t seq;
+    uint16_t len;
+    uint8_t state;
+    char data[DEFAULT_MTU];
+};
+
+enum {
+    FEC_EMPTY,
+    FEC_RECEIVED,
+    FEC_REBUILT
+};
+
+struct fec_parity {
+    uint64_t base;
+    uint32_t count;  /* 0: free entry */
+    uint16_t len;
+    char data[DEFAULT_MTU];
+};
+
+struct mlvpn_fec_rx {
+    uint64_t newest;
+    uint32_t window;  /* slots */
+    struct fec_parity pending[FEC_PENDING];
+    struct fec_slot slot[];
+};
+
+static struct {
+    uint64_t base;
+    uint32_t count;
+    uint32_t size;
+    uint16_t len;
+    char data[DEFAULT_MTU];
+} fec_tx;
+
+/* allocated on the first parity packet received */
+static struct mlvpn_fec_rx *fec_rx = NULL;
+
+static void
+mlvpn_fec_xor(char *dst, const char *src, uint16_t len)
+{
+    uint16_t i;
+    for (i = 0; i < len; i++)
+        dst[i] ^= src[i];
+}
+
+/* Group size for the loss ratio (percent) of the worst link: one parity
+ * packet recovers one loss, aim at one loss per two groups */
+void
+mlvpn_fec_update(int loss)
+{
+    uint32_t size = mlvpn_options.fec;
+    if (loss > 0)
+        size = MIN(size, MAX(MLVPN_FEC_GROUP_MIN, 50 / loss));
+    mlvpn_status.fec_group = size;
+}
+
+/* Add a data packet to the current group, before its encryption.
+ * Returns the parity packet of the group once it is complete.
+ */
+mlvpn_pkt_t *
+mlvpn_fec_tx_add(mlvpn_tunnel_t *tun, mlvpn_pkt_t *pkt, uint64_t seq)
+{
+    mlvpn_pkt_t *parity;
+
+    if (fec_tx.count == 0 || seq != fec_tx.base + fec_tx.count) {
+        /* a new group, or the group can't be completed anymore */
+        fec_tx.base = seq;
+        fec_tx.count = 0;
+        fec_tx.size = mlvpn_status.fec_group;
+        fec_tx.len = 0;
+    }
+    if (fec_tx.size < MLVPN_FEC_GROUP_MIN)
+        return NULL;
+    if (pkt->len > fec_tx.len) {
+        memset(fec_tx.data + fec_tx.len, 0, pkt->len - fec_tx.len);
+        fec_tx.len = pkt->len;
+    }
+    mlvpn_fec_xor(fec_tx.data, pkt->data, pkt->len);
+    if (tun->fec_base != fec_tx.base) {
+        tun->fec_base = fec_tx.base;
+        tun->fec_members = 0;
+    }
+    tun->fec_members++;
+    if (++fec_tx.count < fec_tx.size)
+        return NULL;
+
+    parity = mlvpn_pkt_alloc();
+    parity->type = MLVPN_PKT_FEC;
+    parity->seq = MLVPN_FEC_SEQ(fec_tx.base, fec_tx.count);
+    parity->len = fec_tx.len;
+    memcpy(parity->data, fec_tx.data, fec_tx.len);
+    fec_tx.count = 0;
+    return parity;
+}
+
+#define FEC_RX_SIZE(window) \
+    (sizeof(struct mlvpn_fec_rx) + (window) * sizeof(struct fec_slot))
+
+void
+mlvpn_fec_reset()
+{
+    uint32_t window;
+    if (fec_rx) {
+        window = fec_rx->window;
+        memset(fec_rx, 0, FEC_RX_SIZE(window));
+        fec_rx->window = window;
+    }
+}
+
+/* Allocate the receive window, large enough for the reorder buffer */
+static void
+mlvpn_fec_rx_init()
+{
+    uint32_t window = FEC_WINDOW;
+    if (reorder_buffer)
+        window = MAX(window, mlvpn_reorder_size(reorder_buffer));
+    if (fec_rx && fec_rx->window >= window)
+        return;
+    free(fec_rx);
+    fec_rx = calloc(1, FEC_RX_SIZE(window));
+    if (!fec_rx)
+        fatal("fec", "calloc failed");
+    fec_rx->window = window;
+}
+
+/* Real length of a rebuilt packet, padded with zeros to len */
+static uint16_t
+mlvpn_fec_pktlen(const char *data, uint16_t len)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    uint16_t off = 0;
+    uint32_t iplen = 0;
+
+    if (tuntap.type == MLVPN_TUNTAPMODE_TAP) {
+        off = 14; /* ethernet header */
+        if (len < off)
+            return len;
+    }
+    p += off;
+    if ((p[0] >> 4) == 4 && len - off >= 20)
+        iplen = (p[2] << 8) | p[3];
+    else if ((p[0] >> 4) == 6 && len - off >= 40)
+        iplen = 40 + ((p[4] << 8) | p[5]);
+    if (iplen > 0 && off + iplen <= len)
+        return off + iplen;
+    return len;
+}
+
+static void
+mlvpn_fec_store(uint64_t seq, const char *data, uint16_t len, int state)
+{
+    struct fec_slot *s = &fec_rx->slot[seq % fec_rx->window];
+    s->seq = seq;
+    s->len = len;
+    s->state = state;
+    memcpy(s->data, data, len);
+}
+
+/* Rebuild the missing member of a parity group, if only one is missing.
+ * Returns 1 when the parity can be discarded. */
+static int
+mlvpn_fec_rebuild(struct fec_parity *p, mlvpn_pkt_t **rebuilt)
+{
+    uint64_t seq, missing = 0;
+    uint32_t i, lost = 0;
+    struct fec_slot *s;
+    mlvpn_pkt_t *pkt;
+
+    if (p->base + fec_rx->window <= fec_rx->newest)
+        return 1; /* too old, members were overwritten */
+    for (i = 0; i < p->count; i++) {
+        seq = p->base + i;
+        s = &fec_rx->slot[seq % fec_rx->window];
+        if (s->state == FEC_EMPTY || s->seq != seq) {
+            missing = seq;
+            if (++lost > 1)
+                return 0;
+        }
+    }
+    if (lost == 0)
+        return 1;
+
+    pkt = mlvpn_pkt_alloc();
+    memcpy(pkt->data, p->data, p->len);
+    for (i = 0; i < p->count; i++) {
+        seq = p->base + i;
+        if (seq == missing)
+            continue;
+        s = &fec_rx->slot[seq % fec_rx->window];
+        mlvpn_fec_xor(pkt->data, s->data, MIN(s->len, p->len));
+    }
+    pkt->len = mlvpn_fec_pktlen(pkt->data, p->len);
+    pkt->seq = missing;
+    pkt->type = MLVPN_PKT_DATA;
+    pkt->reorder = 1;
+    mlvpn_fec_store(missing, pkt->data, pkt->len, FEC_REBUILT);
+    mlvpn_status.fec_rebuilt++;
+    log_debug("fec", "packet %"PRIu64" rebuilt", missing);
+    *rebuilt = pkt;
+    return 1;
+}
+
+/* A data packet was received. Returns -1 if it is a duplicate (it was
+ * rebuilt already), 0 otherwise. *rebuilt is set to the packet this one
+ * allowed to rebuild, if any.
+ */
+int
+mlvpn_fec_rx_data(mlvpn_pkt_t *pkt, mlvpn_pkt_t **rebuilt)
+{
+    struct fec_slot *s;
+    struct fec_parity *p;
+    int i;
+
+    *rebuilt = NULL;
+    if (!fec_rx)
+        return 0;
+    if (pkt->seq + fec_rx->window <= fec_rx->newest) {
+        /* too old: its slot was reused, leave it out */
+        return 0;
+    }
+    s = &fec_rx->slot[pkt->seq % fec_rx->window];
+    if (s->state != FEC_EMPTY && s->seq == pkt->seq) {
+        mlvpn_status.fec_duplicates++;
+        return -1;
+    }
+    if (pkt->seq > fec_rx->newest)
+        fec_rx->newest = pkt->seq;
+    mlvpn_fec_store(pkt->seq, pkt->data, pkt->len, FEC_RECEIVED);
+    for (i = 0; i < FEC_PENDING; i++) {
+        p = &fec_rx->pending[i];
+        if (p->count && pkt->seq >= p->base && pkt->seq < p->base + p->count) {
+            if (mlvpn_fec_rebuild(p, rebuilt))
+                p->count = 0;
+            break;
+        }
+    }
+    return 0;
+}
+
+/* A parity packet was received. Returns the member it rebuilt, if any.
+ * The parity is kept until its missing members come in.
+ */
+mlvpn_pkt_t *
+mlvpn_fec_rx_parity(mlvpn_pkt_t *pkt)
+{
+    struct fec_parity parity, *p, *slot = NULL;
+    mlvpn_pkt_t *rebuilt = NULL;
+    int i;
+
+    mlvpn_fec_rx_init();
+    parity.base = MLVPN_FEC_SEQ_BASE(pkt->seq);
+    parity.count = MLVPN_FEC_SEQ_COUNT(pkt->seq);
+    parity.len = pkt->len;
+    if (parity.count == 0)
+        return NULL;
+    memcpy(parity.data, pkt->data, pkt->len);
+    if (mlvpn_fec_rebuild(&parity, &rebuilt))
+        return rebuilt;
+    /* replace a free entry, or the oldest parity */
+    for (i = 0; i < FEC_PENDING; i++) {
+        p = &fec_rx->pending[i];
+        if (p->count == 0 || !slot || p->base < slot->base)
+            slot = p;
+        if (p->count == 0)
+            break;
+    }
+    memcpy(slot, &parity, sizeof(parity));
+    return NULL;
+}
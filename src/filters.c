@@ -12,6 +12,9 @@ mlvpn_filters_choose(uint32_t pktlen, const u_char *pktdata) {
     hdr.len = pktlen;
     for(i = 0; i < mlvpn_filters.count; i++) {
         tun = mlvpn_filters.tun[i];
+        /* duplication filter, see mlvpn_filters_duplicate */
+        if (!tun)
+            continue;
         /* Don't even consider offline interfaces */
         /* log_debug("filters", "check filter[%d] (%s)", i, tun->name); */
         if (pcap_offline_filter(&mlvpn_filters.filter[i], &hdr, pktdata) != 0) {
@@ -25,6 +28,23 @@ mlvpn_filters_choose(uint32_t pktlen, const u_char *pktdata) {
     return NULL;
 }
 
+/* Does the packet match a "duplicate" filter */
+int
+mlvpn_filters_duplicate(uint32_t pktlen, const u_char *pktdata) {
+    int i;
+    struct pcap_pkthdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.caplen = pktlen;
+    hdr.len = pktlen;
+    for(i = 0; i < mlvpn_filters.count; i++) {
+        if (mlvpn_filters.tun[i] == NULL &&
+                pcap_offline_filter(&mlvpn_filters.filter[i], &hdr, pktdata) != 0)
+            return 1;
+    }
+    return 0;
+}
+
+/* tun is NULL for a "duplicate" filter */
 int
 mlvpn_filters_add(const struct bpf_program *filter, mlvpn_tunnel_t *tun) {
     if (mlvpn_filters.count >= 255) {
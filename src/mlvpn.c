@@ -57,6 +57,7 @@
 /* Linux specific things */
 #ifdef HAVE_LINUX
 #include <sys/prctl.h>
+#include <netinet/udp.h>
 #include "systemd.h"
 #endif
 
@@ -81,15 +82,18 @@ char *_progname;
 static char **saved_argv;
 struct ev_loop *loop;
 static ev_timer reorder_drain_timeout;
+static ev_timer nack_timeout;
 static ev_timer reorder_adjust_rtt_timeout;
+static ev_timer rate_timeout;
 char *status_command = NULL;
 char *process_title = NULL;
 int logdebug = 0;
 
 static uint64_t data_seq = 0;
-ev_tstamp lastsent=0;
-uint64_t bandwidthdata=0;
-double bandwidth=0;
+/* highest data_seq received, to rebuild the truncated ones */
+static uint64_t rx_data_seq = 0;
+static uint64_t reorder_pkts = 0; /* packets inserted in the reorder buffer */
+double bandwidth=0; /* kbits/sec sent on all tunnels */
 uint64_t permitted_preset=0;
 
 struct mlvpn_status_s mlvpn_status = {
@@ -119,7 +123,8 @@ struct mlvpn_options_s mlvpn_options = {
     .unpriv_user = "mlvpn",
     .cleartext_data = 1,
     .root_allowed = 0,
-    .reorder_buffer_size = 0
+    .reorder_buffer_size = 0,
+    .scheduler = MLVPN_SCHED_WRR
 };
 #ifdef HAVE_FILTERS
 struct mlvpn_filters_s mlvpn_filters = {
@@ -149,25 +154,30 @@ static struct option long_options[] = {
 static int mlvpn_rtun_start(mlvpn_tunnel_t *t);
 static void mlvpn_rtun_read(EV_P_ ev_io *w, int revents);
 static void mlvpn_rtun_write(EV_P_ ev_io *w, int revents);
+static void mlvpn_rtun_pace_timeout(EV_P_ ev_timer *w, int revents);
+static void mlvpn_tuntap_resume();
 static uint32_t mlvpn_rtun_reorder_drain(uint32_t reorder);
 static void mlvpn_rtun_reorder_drain_timeout(EV_P_ ev_timer *w, int revents);
+static void mlvpn_rtun_nack_timeout(EV_P_ ev_timer *w, int revents);
 static void mlvpn_rtun_check_timeout(EV_P_ ev_timer *w, int revents);
+static void mlvpn_rtun_check_liveness(EV_P_ ev_timer *w, int revents);
+static void mlvpn_rtun_check_lossy(mlvpn_tunnel_t *tun);
 static void mlvpn_rtun_adjust_reorder_timeout(EV_P_ ev_timer *w, int revents);
 static void mlvpn_rtun_send_keepalive(ev_tstamp now, mlvpn_tunnel_t *t);
+static void mlvpn_rtun_send_probe(ev_tstamp now, mlvpn_tunnel_t *t);
 static void mlvpn_rtun_send_disconnect(mlvpn_tunnel_t *t);
 static int mlvpn_rtun_send(mlvpn_tunnel_t *tun, circular_buffer_t *pktbuf);
 static void mlvpn_rtun_send_auth(mlvpn_tunnel_t *t);
 static void mlvpn_rtun_status_up(mlvpn_tunnel_t *t);
 static void mlvpn_rtun_tick_connect(mlvpn_tunnel_t *t);
 static void mlvpn_rtun_recalc_weight();
+static int64_t mlvpn_rtun_quota_burst(mlvpn_tunnel_t *t);
 static void mlvpn_update_status();
 static int mlvpn_rtun_bind(mlvpn_tunnel_t *t);
 static void update_process_title();
 static void mlvpn_tuntap_init();
 static int
-mlvpn_protocol_read(mlvpn_tunnel_t *tun,
-                    mlvpn_pkt_t *rawpkt,
-                    mlvpn_pkt_t *decap_pkt);
+mlvpn_protocol_read(mlvpn_tunnel_t *tun, mlvpn_pkt_t *pkt);
 
 
 static void
@@ -213,15 +223,20 @@ mlvpn_sock_set_nonblocking(int fd)
 inline static 
 void mlvpn_rtun_tick(mlvpn_tunnel_t *t) {
     t->last_activity = ev_now(EV_DEFAULT_UC);
+    if (t->liveness_lost) {
+        log_info("protocol", "%s is alive again", t->name);
+        t->liveness_lost = 0;
+        mlvpn_rtun_check_lossy(t);
+    }
 }
 
-/* Inject the packet to the tuntap device (real network) */
+/* Inject the packet to the tuntap device (real network)
+ * The packet is handed over to the tuntap write buffer.
+ */
 inline static 
 void mlvpn_rtun_inject_tuntap(mlvpn_pkt_t *pkt)
 {
-    mlvpn_pkt_t *tuntap_pkt = mlvpn_pktbuffer_write(tuntap.sbuf);
-    tuntap_pkt->len = pkt->len;
-    memcpy(tuntap_pkt->data, pkt->data, tuntap_pkt->len);
+    mlvpn_pktbuffer_push(tuntap.sbuf, pkt);
     /* Send the packet back into the LAN */
     if (!ev_is_active(&tuntap.io_write)) {
         ev_io_start(EV_A_ &tuntap.io_write);
@@ -234,7 +249,7 @@ mlvpn_rtun_reorder_drain_timeout(EV_P_ ev_timer *w, int revents)
     log_debug("reorder", "reorder timeout. Packet loss?");
 //    printf("Reorder timeout\n");
     mlvpn_reorder_skip(reorder_buffer);
-    mlvpn_rtun_reorder_drain(1);  // MARK = 1, old = 0
+    mlvpn_rtun_reorder_drain(1);
     if (freebuf->used == 0) {
         ev_timer_stop(EV_A_ w);
     }
@@ -247,14 +262,19 @@ mlvpn_rtun_reorder_drain(uint32_t reorder)
     uint32_t drained = 0;
     mlvpn_pkt_t *drained_pkts[1024];
     mlvpn_pkt_t *pkt;
+    uint32_t count;
     /* Try to drain packets */
     if (reorder) {
-        drained = mlvpn_reorder_drain(reorder_buffer, drained_pkts, 1024);
-        for(i = 0; i < drained; i++) {
-            pkt = drained_pkts[i];
-            mlvpn_rtun_inject_tuntap(pkt);
-            mlvpn_freebuffer_free(freebuf, drained_pkts[i]);
-        }
+        /* large buffers may have more than a batch ready */
+        do {
+            count = mlvpn_reorder_drain(reorder_buffer, drained_pkts, 1024);
+            for(i = 0; i < count; i++) {
+                pkt = drained_pkts[i];
+                mlvpn_rtun_inject_tuntap(pkt);
+                mlvpn_freebuffer_free(freebuf, drained_pkts[i]);
+            }
+            drained += count;
+        } while (count == 1024);
     } else {
         while ((pkt = mlvpn_freebuffer_drain_used(freebuf)) != NULL) {
             drained++;
@@ -269,6 +289,156 @@ mlvpn_rtun_reorder_drain(uint32_t reorder)
     return drained;
 }
 
+/* Create the reorder buffer for size packets, or remove it when size is
+ * 0. The packets held are delivered first. The freebuffer is sized to
+ * the ring of the reorder buffer: it never holds more packets.
+ */
+void
+mlvpn_rtun_reorder_resize(uint32_t size)
+{
+    if (reorder_buffer) {
+        mlvpn_rtun_reorder_drain(0);
+        mlvpn_reorder_free(reorder_buffer);
+        reorder_buffer = NULL;
+    }
+    if (size > 0) {
+        reorder_buffer = mlvpn_reorder_create(size);
+        if (reorder_buffer == NULL)
+            fatal("config", "reorder_buffer allocation failed");
+        size = mlvpn_reorder_size(reorder_buffer);
+    }
+    if (freebuf && freebuf->size == size)
+        return;
+    mlvpn_freebuffer_destroy(freebuf);
+    freebuf = NULL;
+    if (size > 0)
+        freebuf = mlvpn_freebuffer_init(size);
+}
+
+/* Wrap a difference of 16 bits timestamps to [-32768, 32768[ */
+static double
+mlvpn_ts16_wrap(double diff)
+{
+    if (diff >= 32768)
+        diff -= 65536;
+    else if (diff < -32768)
+        diff += 65536;
+    return diff;
+}
+
+/* Smooth the one way delay of the peer's packets on this link.
+ * d is our clock minus the peer's timestamp: the clock offset is the
+ * same on every link, so only the difference between links matters.
+ */
+static void
+mlvpn_owd_update(mlvpn_tunnel_t *tun, double d)
+{
+    double delta;
+    if (!tun->owd_hit) {
+        tun->owd = d;
+        tun->owdvar = 0;
+        tun->owd_hit = 1;
+    } else {
+        delta = mlvpn_ts16_wrap(d - tun->owd);
+        tun->owdvar = 0.75 * tun->owdvar + 0.25 * fabs(delta);
+        tun->owd += delta / 8;
+        if (tun->owd < 0)
+            tun->owd += 65536;
+        else if (tun->owd >= 65536)
+            tun->owd -= 65536;
+    }
+}
+
+/* Delay based congestion control (LEDBAT like)
+ * The base delay is the lowest seen in the last minutes, anything above
+ * it is spent in queues. The base of 16 bits timestamps differences
+ * (one way delay) is tracked modulo 65536.
+ */
+static void
+mlvpn_cc_base_sample(struct mlvpn_cc_base *b, double d)
+{
+    ev_tstamp now = ev_now(EV_DEFAULT_UC);
+    if (b->len == 0 || now - b->rotated >= MLVPN_CC_BASE_PERIOD) {
+        b->idx = (b->idx + 1) % MLVPN_CC_HISTORY;
+        if (b->len < MLVPN_CC_HISTORY)
+            b->len++;
+        b->min[b->idx] = d;
+        b->rotated = now;
+    } else if (mlvpn_ts16_wrap(d - b->min[b->idx]) < 0) {
+        b->min[b->idx] = d;
+    }
+    if (!b->cur_hit || mlvpn_ts16_wrap(d - b->cur) < 0) {
+        b->cur = d;
+        b->cur_hit = 1;
+    }
+}
+
+static double
+mlvpn_cc_base(struct mlvpn_cc_base *b)
+{
+    int i;
+    double base = b->min[b->idx];
+    for (i = 0; i < b->len; i++) {
+        if (mlvpn_ts16_wrap(b->min[i] - base) < 0)
+            base = b->min[i];
+    }
+    return base;
+}
+
+/* Adjust the rate allowed on the tunnel when new delays were measured.
+ * The round trip queueing delay, minus the queueing of the peer's
+ * packets (their one way delay above its base), is the queueing on our
+ * upload. Above cc_target the link is limited from the rate it
+ * sustains, then the rate moves by up to MLVPN_CC_GAIN per second in
+ * proportion to the distance to the target. The limit is lifted once
+ * the rate exceeds what the link can use.
+ */
+static void
+mlvpn_cc_update(mlvpn_tunnel_t *t)
+{
+    ev_tstamp now = ev_now(EV_DEFAULT_UC);
+    double qdelay, off_target, capacity, dt;
+
+    if (!t->cc_target || t->status < MLVPN_AUTHOK) {
+        t->cc_qdelay = 0;
+        t->cc_rate = 0;
+        return;
+    }
+    if (!t->rtt_base.cur_hit)
+        return;
+    dt = MIN(now - t->cc_updated, 1.0);
+    t->cc_updated = now;
+    qdelay = t->rtt_base.cur - mlvpn_cc_base(&t->rtt_base);
+    if (t->owd_base.cur_hit)
+        qdelay -= MAX(0, mlvpn_ts16_wrap(
+            t->owd_base.cur - mlvpn_cc_base(&t->owd_base)));
+    t->rtt_base.cur_hit = 0;
+    t->owd_base.cur_hit = 0;
+    t->cc_qdelay = MAX(0, qdelay);
+
+    off_target = (t->cc_target - t->cc_qdelay) / t->cc_target;
+    if (off_target < -1)
+        off_target = -1;
+    if (t->cc_rate == 0) {
+        if (off_target >= 0)
+            return;
+        t->cc_rate = MAX(t->send_rate, MLVPN_CC_MIN_RATE);
+        log_debug("cc", "%s queueing delay %ums, limiting to %u bytes/s",
+            t->name, (uint32_t)t->cc_qdelay, (uint32_t)t->cc_rate);
+    }
+    t->cc_rate *= exp(MLVPN_CC_GAIN * off_target * dt);
+    if (t->cc_rate < MLVPN_CC_MIN_RATE)
+        t->cc_rate = MLVPN_CC_MIN_RATE;
+
+    capacity = t->bandwidth ? t->bandwidth : t->bandwidth_probe;
+    if (off_target > 0 &&
+            t->cc_rate >= (capacity ? capacity : 2 * t->send_rate)) {
+        log_debug("cc", "%s queueing delay %ums, limit lifted",
+            t->name, (uint32_t)t->cc_qdelay);
+        t->cc_rate = 0;
+    }
+}
+
 /* Count the loss on the last 64 packets */
 static void
 mlvpn_loss_update(mlvpn_tunnel_t *tun, uint64_t seq)
@@ -315,22 +485,22 @@ mlvpn_loss_ratio(mlvpn_tunnel_t *tun)
     return (loss * 100) / 64;
 }
 
+/* Reorder or inject a data packet. Takes ownership of pkt. */
 static int
-mlvpn_rtun_recv_data(mlvpn_tunnel_t *tun, mlvpn_pkt_t *inpkt)
+mlvpn_rtun_recv_data(mlvpn_tunnel_t *tun, mlvpn_pkt_t *pkt)
 {
     int ret;
     uint32_t drained;
-    if (reorder_buffer == NULL || !inpkt->reorder) {
-        mlvpn_rtun_inject_tuntap(inpkt);
+    if (reorder_buffer == NULL || !pkt->reorder) {
+        mlvpn_rtun_inject_tuntap(pkt);
         return 1;
     } else {
-        mlvpn_pkt_t *pkt = mlvpn_freebuffer_get(freebuf);
-        if (!pkt) {
+        reorder_pkts++;
+        if (mlvpn_freebuffer_put(freebuf, pkt) < 0) {
             log_warnx("reorder", "freebuffer full: reorder_buffer_size must be increased.");
-            mlvpn_rtun_inject_tuntap(inpkt);
+            mlvpn_rtun_inject_tuntap(pkt);
             return 1;
         }
-        memcpy(pkt, inpkt, sizeof(mlvpn_pkt_t));
         ret = mlvpn_reorder_insert(reorder_buffer, pkt);
         if (ret == -1) {
             log_warnx("net", "reorder_buffer_insert failed: %d", ret);
@@ -341,8 +511,14 @@ mlvpn_rtun_recv_data(mlvpn_tunnel_t *tun, mlvpn_pkt_t *inpkt)
              * after the forced drain (packet loss)
              * Just inject the packet as is
              */
-            mlvpn_rtun_inject_tuntap(inpkt);
+            mlvpn_freebuffer_free(freebuf, pkt);
+            mlvpn_rtun_inject_tuntap(pkt);
             return 1;
+        } else if (ret == -3) {
+            /* already held: drop the copy */
+            mlvpn_freebuffer_free(freebuf, pkt);
+            mlvpn_pkt_release(pkt);
+            return 0;
         } else {
             drained = mlvpn_rtun_reorder_drain(1);
         }
@@ -355,6 +531,420 @@ mlvpn_rtun_recv_data(mlvpn_tunnel_t *tun, mlvpn_pkt_t *inpkt)
 }
 
 
+/* Lowest round trip time tunnel in aggregation, for packets in a hurry */
+static mlvpn_tunnel_t *
+mlvpn_rtun_fastest()
+{
+    mlvpn_tunnel_t *t, *best = NULL;
+    LIST_FOREACH(t, &rtuns, entries) {
+        if (t->wrr_slot < 0)
+            continue;
+        if (!best || t->srtt < best->srtt)
+            best = t;
+    }
+    return best;
+}
+
+static void
+mlvpn_rtun_send_hp(mlvpn_tunnel_t *t, mlvpn_pkt_t *pkt)
+{
+    if (mlvpn_cb_is_full(t->hpsbuf)) {
+        log_warnx("net", "%s high priority buffer: overflow", t->name);
+        mlvpn_pkt_release(pkt);
+        return;
+    }
+    mlvpn_pktbuffer_push(t->hpsbuf, pkt);
+    if (!ev_is_active(&t->io_write))
+        ev_io_start(EV_A_ &t->io_write);
+}
+
+/* Request the holes due (see nack.c) */
+static void
+mlvpn_rtun_nack_timeout(EV_P_ ev_timer *w, int revents)
+{
+    mlvpn_tunnel_t *t;
+    mlvpn_pkt_t *pkt = mlvpn_nack_build(ev_now(EV_A));
+    if (pkt) {
+        if ((t = mlvpn_rtun_fastest()) != NULL && t->peer_version >= 2) {
+            log_debug("nack", "%s requesting %d packets", t->name,
+                (int)(pkt->len / sizeof(uint64_t)));
+            mlvpn_rtun_send_hp(t, pkt);
+        } else {
+            mlvpn_pkt_release(pkt);
+        }
+    }
+    if (!mlvpn_nack_pending())
+        ev_timer_stop(EV_A_ w);
+}
+
+/* Send again the packets requested by the peer, on the fastest link */
+static void
+mlvpn_rtun_recv_nack(mlvpn_pkt_t *pkt)
+{
+    mlvpn_pkt_t *rtx[DEFAULT_MTU / sizeof(uint64_t)];
+    mlvpn_tunnel_t *t = mlvpn_rtun_fastest();
+    int i, n;
+
+    n = mlvpn_nack_recv(pkt, rtx, sizeof(rtx) / sizeof(rtx[0]));
+    for (i = 0; i < n; i++) {
+        if (t && t->peer_version >= 2)
+            mlvpn_rtun_send_hp(t, rtx[i]);
+        else
+            mlvpn_pkt_release(rtx[i]);
+    }
+}
+
+/* Handle a capacity probe (see mlvpn_rtun_send_probe) or its reply.
+ * len is the datagram size on the wire.
+ */
+static void
+mlvpn_rtun_recv_probe(mlvpn_tunnel_t *tun, mlvpn_pkt_t *pkt, ssize_t len)
+{
+    mlvpn_probe_t *probe = (mlvpn_probe_t *)pkt->data;
+    mlvpn_pkt_t *reply;
+    /* arrival time of this very datagram, not of the loop iteration */
+    ev_tstamp now = ev_time();
+    uint16_t train;
+    double rate;
+
+    if (pkt->len < sizeof(*probe))
+        return;
+    train = be16toh(probe->train);
+    if (pkt->type == MLVPN_PKT_PROBE_REPLY) {
+        rate = be32toh(probe->rate);
+        if (train != tun->probe_train || rate == 0)
+            return;
+        if (tun->bandwidth_probe == 0)
+            tun->bandwidth_probe = rate;
+        else
+            tun->bandwidth_probe = 0.75 * tun->bandwidth_probe + 0.25 * rate;
+        log_debug("probe", "%s capacity %u bytes/s (train: %u bytes/s)",
+            tun->name, tun->bandwidth_probe, (uint32_t)rate);
+        return;
+    }
+
+    if (tun->probe_rx_count == 0 || train != tun->probe_rx_train) {
+        tun->probe_rx_train = train;
+        tun->probe_rx_count = 1;
+        tun->probe_rx_bytes = 0;
+        tun->probe_rx_first = now;
+    } else {
+        tun->probe_rx_count++;
+        tun->probe_rx_bytes += len + IP4_UDP_OVERHEAD;
+    }
+    tun->probe_rx_last = now;
+    if (probe->idx + 1 < probe->count)
+        return;
+
+    /* end of the train, unless it went by too fast to be timed */
+    if (tun->probe_rx_count >= 2 &&
+            now - tun->probe_rx_first >= MLVPN_PROBE_MIN_DISPERSION) {
+        rate = tun->probe_rx_bytes / (now - tun->probe_rx_first);
+        if (mlvpn_cb_is_full(tun->hpsbuf)) {
+            log_warnx("net", "%s high priority buffer: overflow", tun->name);
+        } else {
+            reply = mlvpn_pkt_alloc();
+            reply->type = MLVPN_PKT_PROBE_REPLY;
+            reply->len = sizeof(*probe);
+            probe = (mlvpn_probe_t *)reply->data;
+            probe->train = htobe16(train);
+            probe->idx = 0;
+            probe->count = 1;
+            probe->rate = htobe32(MIN(rate, UINT32_MAX));
+            mlvpn_pktbuffer_push(tun->hpsbuf, reply);
+            if (!ev_is_active(&tun->io_write))
+                ev_io_start(EV_A_ &tun->io_write);
+        }
+    }
+    tun->probe_rx_count = 0;
+}
+
+/* Hand a data packet received over to the data path, unless it came in
+ * already (duplicated, retransmitted or rebuilt). Takes ownership of pkt.
+ * rtx: sent again after a NACK, dup: copy of a duplicated packet.
+ */
+static void
+mlvpn_rtun_recv_seq(mlvpn_tunnel_t *tun, mlvpn_pkt_t *pkt, int rtx, int dup)
+{
+    mlvpn_pkt_t *rebuilt;
+
+    pkt->type = MLVPN_PKT_DATA;
+    if (mlvpn_dup_rx_data(pkt, dup) < 0 ||
+            mlvpn_nack_rx_data(pkt, rtx) < 0 ||
+            mlvpn_fec_rx_data(pkt, &rebuilt) < 0) {
+        log_debug("protocol", "%s packet %"PRIu64" received twice",
+            tun->name, pkt->seq);
+        mlvpn_pkt_release(pkt);
+        return;
+    }
+    if (rebuilt) {
+        if (mlvpn_dup_rx_data(rebuilt, 0) < 0 ||
+                mlvpn_nack_rx_data(rebuilt, 0) < 0)
+            mlvpn_pkt_release(rebuilt);
+        else
+            mlvpn_rtun_recv_data(tun, rebuilt);
+    }
+    mlvpn_rtun_recv_data(tun, pkt);
+    if (!ev_is_active(&nack_timeout) && mlvpn_nack_pending())
+        ev_timer_start(EV_A_ &nack_timeout);
+}
+
+/* Split a bundle (see mlvpn_rtun_read_data) into its data packets */
+static void
+mlvpn_rtun_recv_bundle(mlvpn_tunnel_t *tun, mlvpn_pkt_t *bundle)
+{
+    mlvpn_pkt_t *pkt;
+    uint64_t seq = bundle->seq;
+    uint16_t off = 0, len;
+
+    while (off + MLVPN_BUNDLE_HDRSIZ <= bundle->len) {
+        memcpy(&len, bundle->data + off, sizeof(len));
+        len = be16toh(len);
+        off += MLVPN_BUNDLE_HDRSIZ;
+        if (len == 0 || len > bundle->len - off) {
+            log_warnx("protocol", "%s invalid bundle", tun->name);
+            return;
+        }
+        pkt = mlvpn_pkt_alloc();
+        pkt->seq = seq;
+        pkt->reorder = bundle->reorder;
+        pkt->len = len;
+        memcpy(pkt->data, bundle->data + off, len);
+        off += len;
+        mlvpn_loss_update(tun, seq++);
+        mlvpn_rtun_recv_seq(tun, pkt, 0, 0);
+    }
+}
+
+/* Handle a single datagram received on the rtunnel.
+ * pkt holds the datagram at MLVPN_PKT_WIRE(pkt), it is decapsulated in
+ * place and either handed over to the data path or released.
+ */
+static void
+mlvpn_rtun_recv_pkt(mlvpn_tunnel_t *tun, mlvpn_pkt_t *pkt,
+                    struct sockaddr_storage *clientaddr, socklen_t addrlen)
+{
+    ssize_t len = pkt->len;
+    mlvpn_pkt_t *rebuilt;
+
+    /* validate the received packet */
+    if (mlvpn_protocol_read(tun, pkt) < 0) {
+        mlvpn_pkt_release(pkt);
+        return;
+    }
+
+    tun->recvbytes += len;
+    tun->recvpackets += 1;
+    if (tun->quota) {
+      tun->permitted -= len;
+    }
+
+    if (! tun->addrinfo)
+        fatalx("tun->addrinfo is NULL!");
+
+    if ((tun->addrinfo->ai_addrlen != addrlen) ||
+            (memcmp(tun->addrinfo->ai_addr, clientaddr, addrlen) != 0)) {
+        if (mlvpn_options.cleartext_data && tun->status >= MLVPN_AUTHOK) {
+            log_warnx("protocol", "%s rejected non authenticated connection",
+                tun->name);
+            mlvpn_pkt_release(pkt);
+            return;
+        }
+        char clienthost[NI_MAXHOST];
+        char clientport[NI_MAXSERV];
+        int ret;
+        if ( (ret = getnameinfo((struct sockaddr *)clientaddr, addrlen,
+                                clienthost, sizeof(clienthost),
+                                clientport, sizeof(clientport),
+                                NI_NUMERICHOST|NI_NUMERICSERV)) < 0) {
+            log_warn("protocol", "%s error in getnameinfo: %d",
+                   tun->name, ret);
+        } else {
+            log_info("protocol", "%s new connection -> %s:%s",
+               tun->name, clienthost, clientport);
+            memcpy(tun->addrinfo->ai_addr, clientaddr, addrlen);
+        }
+    }
+    log_debug("net", "< %s recv %d bytes (type=%d, seq=%"PRIu64", reorder=%d)",
+        tun->name, (int)len, pkt->type, pkt->seq, pkt->reorder);
+
+    if (pkt->type == MLVPN_PKT_DATA || pkt->type == MLVPN_PKT_RETRANSMIT ||
+            pkt->type == MLVPN_PKT_DUPLICATE) {
+        if (tun->status >= MLVPN_AUTHOK) {
+            mlvpn_rtun_tick(tun);
+            mlvpn_rtun_recv_seq(tun, pkt,
+                pkt->type == MLVPN_PKT_RETRANSMIT,
+                pkt->type == MLVPN_PKT_DUPLICATE);
+            return;
+        } else {
+            log_debug("protocol", "%s ignoring non authenticated packet",
+                tun->name);
+        }
+    } else if (pkt->type == MLVPN_PKT_KEEPALIVE &&
+            tun->status >= MLVPN_AUTHOK) {
+        int echo = pkt->len > 0 && pkt->data[0] == MLVPN_KEEPALIVE_ECHO;
+        log_debug("protocol", "%s keepalive received", tun->name);
+        mlvpn_rtun_tick(tun);
+        tun->last_keepalive_ack = ev_now(EV_DEFAULT_UC);
+        /* Avoid flooding the network if multiple packets are queued.
+         * Liveness probes are answered at once, once per loop. */
+        if (tun->last_keepalive_ack_sent + (echo ? 0 : 1) <
+                tun->last_keepalive_ack) {
+            tun->last_keepalive_ack_sent = tun->last_keepalive_ack;
+            mlvpn_rtun_send_keepalive(tun->last_keepalive_ack, tun);
+            if (echo && !ev_is_active(&tun->io_write))
+                ev_io_start(EV_A_ &tun->io_write);
+        }
+    } else if ((pkt->type == MLVPN_PKT_PROBE ||
+                pkt->type == MLVPN_PKT_PROBE_REPLY) &&
+            tun->status >= MLVPN_AUTHOK) {
+        mlvpn_rtun_tick(tun);
+        mlvpn_rtun_recv_probe(tun, pkt, len);
+    } else if (pkt->type == MLVPN_PKT_FEC && tun->status >= MLVPN_AUTHOK) {
+        mlvpn_rtun_tick(tun);
+        if ((rebuilt = mlvpn_fec_rx_parity(pkt)) != NULL) {
+            if (mlvpn_dup_rx_data(rebuilt, 0) < 0 ||
+                    mlvpn_nack_rx_data(rebuilt, 0) < 0)
+                mlvpn_pkt_release(rebuilt);
+            else
+                mlvpn_rtun_recv_data(tun, rebuilt);
+        }
+    } else if (pkt->type == MLVPN_PKT_BUNDLE && tun->status >= MLVPN_AUTHOK) {
+        mlvpn_rtun_tick(tun);
+        mlvpn_rtun_recv_bundle(tun, pkt);
+    } else if (pkt->type == MLVPN_PKT_NACK && tun->status >= MLVPN_AUTHOK) {
+        mlvpn_rtun_tick(tun);
+        mlvpn_rtun_recv_nack(pkt);
+    } else if (pkt->type == MLVPN_PKT_DISCONNECT &&
+            tun->status >= MLVPN_AUTHOK) {
+        log_info("protocol", "%s disconnect received", tun->name);
+        mlvpn_rtun_status_down(tun);
+    } else if (pkt->type == MLVPN_PKT_AUTH ||
+            pkt->type == MLVPN_PKT_AUTH_OK) {
+        mlvpn_rtun_send_auth(tun);
+    }
+    mlvpn_pkt_release(pkt);
+}
+
+#ifdef UDP_GRO
+/* Split a buffer coalesced by UDP GRO back into the original datagrams.
+ * The segment size is given by the UDP_GRO control message; without it
+ * the buffer holds a single datagram. Every segment is copied once into
+ * a pool packet.
+ */
+static void
+mlvpn_rtun_recv_gro(mlvpn_tunnel_t *tun, struct msghdr *msg, size_t len,
+                    struct sockaddr_storage *clientaddr, socklen_t addrlen)
+{
+    mlvpn_pkt_t *pkt;
+    struct cmsghdr *cmsg;
+    const char *buf = msg->msg_iov[0].iov_base;
+    size_t off, seglen, segsize = len;
+    int gso_size;
+
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+            memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+            if (gso_size > 0)
+                segsize = gso_size;
+        }
+    }
+    for (off = 0; off < len; off += seglen) {
+        seglen = MIN(segsize, len - off);
+        if (seglen > MLVPN_PKT_WIRESIZ) {
+            log_warnx("net", "%s GRO segment too long: %u",
+                tun->name, (unsigned int)seglen);
+            continue;
+        }
+        pkt = mlvpn_pkt_alloc();
+        memcpy(MLVPN_PKT_WIRE(pkt), buf + off, seglen);
+        pkt->len = seglen;
+        mlvpn_rtun_recv_pkt(tun, pkt, clientaddr, addrlen);
+    }
+}
+#endif
+
+#ifdef HAVE_RECVMMSG
+/* Drain up to tun->recv_batch datagrams with a single recvmmsg(2) call.
+ * With UDP GRO enabled every message may carry several datagrams of the
+ * same size, which are split before being handled.
+ * Returns -1 if the running kernel does not implement recvmmsg, so the
+ * caller can fall back to recvfrom(2).
+ */
+static int
+mlvpn_rtun_read_batch(mlvpn_tunnel_t *tun)
+{
+    /* pool packets, kept across calls until a datagram is stored */
+    static mlvpn_pkt_t *pkts[MLVPN_BATCH_MAX];
+    static struct sockaddr_storage addrs[MLVPN_BATCH_MAX];
+    static struct iovec iovs[MLVPN_BATCH_MAX];
+    static struct mmsghdr msgs[MLVPN_BATCH_MAX];
+#ifdef UDP_GRO
+    static char grobufs[MLVPN_GRO_BATCH][MLVPN_GRO_BUFSIZ];
+    static union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctrl[MLVPN_GRO_BATCH];
+#endif
+    unsigned int vlen = tun->recv_batch;
+    int i, ret;
+
+    if (vlen > MLVPN_BATCH_MAX)
+        vlen = MLVPN_BATCH_MAX;
+#ifdef UDP_GRO
+    if (tun->udp_gro && vlen > MLVPN_GRO_BATCH)
+        vlen = MLVPN_GRO_BATCH;
+#endif
+    for (i = 0; i < vlen; i++) {
+        if (! pkts[i])
+            pkts[i] = mlvpn_pkt_alloc();
+        iovs[i].iov_base = MLVPN_PKT_WIRE(pkts[i]);
+        iovs[i].iov_len = MLVPN_PKT_WIRESIZ;
+        memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+#ifdef UDP_GRO
+        if (tun->udp_gro) {
+            iovs[i].iov_base = grobufs[i];
+            iovs[i].iov_len = sizeof(grobufs[i]);
+            msgs[i].msg_hdr.msg_control = ctrl[i].buf;
+            msgs[i].msg_hdr.msg_controllen = sizeof(ctrl[i].buf);
+        }
+#endif
+    }
+    ret = recvmmsg(tun->fd, msgs, vlen, MSG_DONTWAIT, NULL);
+    if (ret < 0) {
+        if (errno == ENOSYS)
+            return -1;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            log_warn("net", "%s read error", tun->name);
+            mlvpn_rtun_status_down(tun);
+        }
+        return 0;
+    }
+    for (i = 0; i < ret; i++) {
+        if (msgs[i].msg_len == 0) {
+            log_info("protocol", "%s peer closed the connection", tun->name);
+            continue;
+        }
+#ifdef UDP_GRO
+        if (tun->udp_gro) {
+            mlvpn_rtun_recv_gro(tun, &msgs[i].msg_hdr, msgs[i].msg_len,
+                &addrs[i], msgs[i].msg_hdr.msg_namelen);
+            continue;
+        }
+#endif
+        pkts[i]->len = msgs[i].msg_len;
+        mlvpn_rtun_recv_pkt(tun, pkts[i], &addrs[i],
+            msgs[i].msg_hdr.msg_namelen);
+        pkts[i] = NULL;
+    }
+    return ret;
+}
+#endif
+
 /* read from the rtunnel => write directly to the tap send buffer */
 static void
 mlvpn_rtun_read(EV_P_ ev_io *w, int revents)
@@ -363,131 +953,187 @@ mlvpn_rtun_read(EV_P_ ev_io *w, int revents)
     ssize_t len;
     struct sockaddr_storage clientaddr;
     socklen_t addrlen = sizeof(clientaddr);
-    mlvpn_pkt_t pkt;
-    len = recvfrom(tun->fd, pkt.data,
-                   sizeof(pkt.data),
+    mlvpn_pkt_t *pkt;
+#ifdef HAVE_RECVMMSG
+    /* GRO buffers can only be read through the batch path */
+    if (tun->recv_batch > 1 || tun->udp_gro) {
+        if (mlvpn_rtun_read_batch(tun) >= 0)
+            return;
+        log_warnx("net", "%s recvmmsg not supported, recv_batch disabled",
+            tun->name);
+        tun->recv_batch = 1;
+    }
+#endif
+    pkt = mlvpn_pkt_alloc();
+    len = recvfrom(tun->fd, MLVPN_PKT_WIRE(pkt),
+                   MLVPN_PKT_WIRESIZ,
                    MSG_DONTWAIT, (struct sockaddr *)&clientaddr, &addrlen);
     if (len < 0) {
         if (errno != EAGAIN && errno != EWOULDBLOCK) {
             log_warn("net", "%s read error", tun->name);
             mlvpn_rtun_status_down(tun);
         }
+        mlvpn_pkt_release(pkt);
     } else if (len == 0) {
         log_info("protocol", "%s peer closed the connection", tun->name);
+        mlvpn_pkt_release(pkt);
     } else {
-        pkt.len = len;
-        mlvpn_pkt_t decap_pkt;
-
-        /* validate the received packet */
-        if (mlvpn_protocol_read(tun, &pkt, &decap_pkt) < 0) {
-            return;
-        }
-
-        tun->recvbytes += len;
-        tun->recvpackets += 1;
-        if (tun->quota) {
-          tun->permitted -= len;
-        }
+        pkt->len = len;
+        mlvpn_rtun_recv_pkt(tun, pkt, &clientaddr, addrlen);
+    }
+}
 
-        if (! tun->addrinfo)
-            fatalx("tun->addrinfo is NULL!");
+/* Rebuild a sequence number from its 32 low bits: the closest one to
+ * ref, the highest received */
+static uint64_t
+mlvpn_seq_rebuild(uint64_t ref, uint32_t low)
+{
+    const uint64_t wrap = (uint64_t)1 << 32;
+    uint64_t seq = (ref & ~(wrap - 1)) | low;
+    if (seq > ref && seq - ref > wrap / 2 && seq >= wrap)
+        seq -= wrap;
+    else if (seq < ref && ref - seq > wrap / 2)
+        seq += wrap;
+    return seq;
+}
 
-        if ((tun->addrinfo->ai_addrlen != addrlen) ||
-                (memcmp(tun->addrinfo->ai_addr, &clientaddr, addrlen) != 0)) {
-            if (mlvpn_options.cleartext_data && tun->status >= MLVPN_AUTHOK) {
-                log_warnx("protocol", "%s rejected non authenticated connection",
-                    tun->name);
-                return;
-            }
-            char clienthost[NI_MAXHOST];
-            char clientport[NI_MAXSERV];
-            int ret;
-            if ( (ret = getnameinfo((struct sockaddr *)&clientaddr, addrlen,
-                                    clienthost, sizeof(clienthost),
-                                    clientport, sizeof(clientport),
-                                    NI_NUMERICHOST|NI_NUMERICSERV)) < 0) {
-                log_warn("protocol", "%s error in getnameinfo: %d",
-                       tun->name, ret);
-            } else {
-                log_info("protocol", "%s new connection -> %s:%s",
-                   tun->name, clienthost, clientport);
-                memcpy(tun->addrinfo->ai_addr, &clientaddr, addrlen);
-            }
-        }
-        log_debug("net", "< %s recv %d bytes (type=%d, seq=%"PRIu64", reorder=%d)",
-            tun->name, (int)len, decap_pkt.type, decap_pkt.seq, decap_pkt.reorder);
+/* Turn a datagram with a compact header (mlvpn_proto2_t) into the full
+ * header layout, in place: the truncated sequence numbers are rebuilt,
+ * flow_id is the one of the peer, and the payload moves to its usual
+ * place in front of pkt->data. Returns -1 if the datagram is invalid.
+ */
+static int
+mlvpn_proto_expand(mlvpn_tunnel_t *tun, mlvpn_pkt_t *pkt)
+{
+    mlvpn_proto_t *proto = (mlvpn_proto_t *)MLVPN_PKT_WIRE(pkt);
+    unsigned char *p = (unsigned char *)proto;
+    mlvpn_proto2_t hdr;
+    uint16_t reply = (uint16_t)-1;
+    uint32_t seq32;
+    uint64_t seq64 = 0;
+    size_t hlen, off = sizeof(hdr);
+
+    memcpy(&hdr, p, sizeof(hdr));
+    hlen = MLVPN_PROTO2_HDRSIZ(&hdr);
+    if (pkt->len < hlen || pkt->len - hlen > sizeof(proto->data))
+        return -1;
+    if (hdr.has_reply) {
+        memcpy(&reply, p + off, sizeof(reply));
+        reply = be16toh(reply);
+        off += sizeof(reply);
+    }
+    if (hdr.has_data_seq && hdr.long_data_seq) {
+        memcpy(&seq64, p + off, sizeof(seq64));
+        seq64 = be64toh(seq64);
+    } else if (hdr.has_data_seq) {
+        memcpy(&seq32, p + off, sizeof(seq32));
+        seq64 = mlvpn_seq_rebuild(rx_data_seq, be32toh(seq32));
+    }
+    memmove(p + MLVPN_PROTO_HDRSIZ, p + hlen, pkt->len - hlen);
+    pkt->len += MLVPN_PROTO_HDRSIZ - hlen;
+
+    memset(proto, 0, MLVPN_PROTO_HDRSIZ);
+    proto->len = hdr.len;
+    proto->version = hdr.version;
+    proto->flags = hdr.flags;
+    proto->reorder = hdr.reorder;
+    proto->timestamp = hdr.timestamp;
+    proto->timestamp_reply = htobe16(reply);
+    proto->flow_id = htobe32(tun->peer_flow_id);
+    proto->seq = htobe64(mlvpn_seq_rebuild(tun->peer_seq, be32toh(hdr.seq)));
+    proto->data_seq = htobe64(seq64);
+    return 0;
+}
 
-        if (decap_pkt.type == MLVPN_PKT_DATA) {
-            if (tun->status >= MLVPN_AUTHOK) {
-                mlvpn_rtun_tick(tun);
-                mlvpn_rtun_recv_data(tun, &decap_pkt);
-            } else {
-                log_debug("protocol", "%s ignoring non authenticated packet",
-                    tun->name);
-            }
-        } else if (decap_pkt.type == MLVPN_PKT_KEEPALIVE &&
-                tun->status >= MLVPN_AUTHOK) {
-            log_debug("protocol", "%s keepalive received", tun->name);
-            mlvpn_rtun_tick(tun);
-            tun->last_keepalive_ack = ev_now(EV_DEFAULT_UC);
-            /* Avoid flooding the network if multiple packets are queued */
-            if (tun->last_keepalive_ack_sent + 1 < tun->last_keepalive_ack) {
-                tun->last_keepalive_ack_sent = tun->last_keepalive_ack;
-                mlvpn_rtun_send_keepalive(tun->last_keepalive_ack, tun);
-            }
-        } else if (decap_pkt.type == MLVPN_PKT_DISCONNECT &&
-                tun->status >= MLVPN_AUTHOK) {
-            log_info("protocol", "%s disconnect received", tun->name);
-            mlvpn_rtun_status_down(tun);
-        } else if (decap_pkt.type == MLVPN_PKT_AUTH ||
-                decap_pkt.type == MLVPN_PKT_AUTH_OK) {
-            mlvpn_rtun_send_auth(tun);
-        }
-    }
+/* Turn the full header of a datagram ready to be sent, still in host
+ * byte order, into a compact header (mlvpn_proto2_t). The header shrinks
+ * in place, right in front of the payload. Returns the new length of
+ * the datagram.
+ */
+static ssize_t
+mlvpn_proto_compact(mlvpn_proto_t *proto, size_t wlen, mlvpn_proto_t **wire)
+{
+    unsigned char *p;
+    mlvpn_proto2_t hdr;
+    uint16_t reply = htobe16(proto->timestamp_reply);
+    uint32_t seq32 = htobe32((uint32_t)proto->data_seq);
+    uint64_t seq64 = htobe64(proto->data_seq);
+    size_t hlen, off = sizeof(hdr);
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.len = htobe16(proto->len);
+    hdr.version = MLVPN_PROTOCOL_VERSION;
+    hdr.flags = proto->flags;
+    hdr.reorder = proto->reorder;
+    hdr.has_reply = proto->timestamp_reply != (uint16_t)-1;
+    hdr.has_data_seq = MLVPN_PKT_HAS_DATA_SEQ(proto->flags);
+    hdr.long_data_seq = proto->flags == MLVPN_PKT_FEC;
+    hdr.timestamp = htobe16(proto->timestamp);
+    hdr.seq = htobe32((uint32_t)proto->seq);
+    hlen = MLVPN_PROTO2_HDRSIZ(&hdr);
+
+    /* every field was read, the compact header may overwrite them */
+    p = (unsigned char *)proto + MLVPN_PROTO_HDRSIZ - hlen;
+    memcpy(p, &hdr, sizeof(hdr));
+    if (hdr.has_reply) {
+        memcpy(p + off, &reply, sizeof(reply));
+        off += sizeof(reply);
+    }
+    if (hdr.has_data_seq && hdr.long_data_seq)
+        memcpy(p + off, &seq64, sizeof(seq64));
+    else if (hdr.has_data_seq)
+        memcpy(p + off, &seq32, sizeof(seq32));
+    *wire = (mlvpn_proto_t *)p;
+    return wlen - MLVPN_PROTO_HDRSIZ + hlen;
 }
 
+/* Validate and decapsulate in place the datagram stored at
+ * MLVPN_PKT_WIRE(pkt). On success pkt->data holds the payload.
+ */
 static int
-mlvpn_protocol_read(
-    mlvpn_tunnel_t *tun, mlvpn_pkt_t *pkt,
-    mlvpn_pkt_t *decap_pkt)
+mlvpn_protocol_read(mlvpn_tunnel_t *tun, mlvpn_pkt_t *pkt)
 {
     unsigned char nonce[crypto_NONCEBYTES];
-    int ret;
+    int ret, compact;
     uint16_t rlen;
-    mlvpn_proto_t proto;
+    mlvpn_proto_t *proto = (mlvpn_proto_t *)MLVPN_PKT_WIRE(pkt);
     uint64_t now64 = mlvpn_timestamp64(ev_now(EV_DEFAULT_UC));
-    /* Overkill */
-    memset(&proto, 0, sizeof(proto));
-    memset(decap_pkt, 0, sizeof(*decap_pkt));
 
-    /* pkt->data contains mlvpn_proto_t struct */
-    if (pkt->len > sizeof(pkt->data) || pkt->len > sizeof(proto) ||
-            pkt->len < (PKTHDRSIZ(proto))) {
+    if (pkt->len > sizeof(*proto) || pkt->len < sizeof(mlvpn_proto2_t)) {
         log_warnx("protocol", "%s received invalid packet of %d bytes",
             tun->name, pkt->len);
         goto fail;
     }
-    memcpy(&proto, pkt->data, pkt->len);
-    rlen = be16toh(proto.len);
-    if (rlen == 0 || rlen > sizeof(proto.data)) {
+    compact = proto->version >= 2 && proto->flags != MLVPN_PKT_AUTH &&
+        proto->flags != MLVPN_PKT_AUTH_OK;
+    if ((compact && mlvpn_proto_expand(tun, pkt) < 0) ||
+            pkt->len < MLVPN_PROTO_HDRSIZ) {
+        log_warnx("protocol", "%s received invalid packet of %d bytes",
+            tun->name, pkt->len);
+        goto fail;
+    }
+    rlen = be16toh(proto->len);
+    if (rlen == 0 || rlen > sizeof(proto->data) ||
+            rlen > pkt->len - MLVPN_PROTO_HDRSIZ) {
         log_warnx("protocol", "%s invalid packet size: %d", tun->name, rlen);
         goto fail;
     }
 
-    proto.seq = be64toh(proto.seq);
-    proto.timestamp = be16toh(proto.timestamp);
-    proto.timestamp_reply = be16toh(proto.timestamp_reply);
-    proto.flow_id = be32toh(proto.flow_id);
+    proto->seq = be64toh(proto->seq);
+    proto->timestamp = be16toh(proto->timestamp);
+    proto->timestamp_reply = be16toh(proto->timestamp_reply);
+    proto->flow_id = be32toh(proto->flow_id);
     /* now auth the packet using libsodium before further checks */
 #ifdef ENABLE_CRYPTO
-    if (mlvpn_options.cleartext_data && proto.flags == MLVPN_PKT_DATA) {
-        memcpy(decap_pkt->data, &proto.data, rlen);
+    if (mlvpn_options.cleartext_data && proto->flags == MLVPN_PKT_DATA) {
+        memmove(pkt->data, &proto->data, rlen);
     } else {
         sodium_memzero(nonce, sizeof(nonce));
-        memcpy(nonce, &proto.seq, sizeof(proto.seq));
-        memcpy(nonce + sizeof(proto.seq), &proto.flow_id, sizeof(proto.flow_id));
-        if ((ret = crypto_decrypt((unsigned char *)decap_pkt->data,
-                                  (const unsigned char *)&proto.data, rlen,
+        memcpy(nonce, &proto->seq, sizeof(proto->seq));
+        memcpy(nonce + sizeof(proto->seq), &proto->flow_id, sizeof(proto->flow_id));
+        /* the ciphertext starts right at pkt->data, after the MAC */
+        if ((ret = crypto_decrypt((unsigned char *)pkt->data,
+                                  (const unsigned char *)&proto->data, rlen,
                                   nonce)) != 0) {
             log_warnx("protocol", "%s crypto_decrypt failed: %d",
                 tun->name, ret);
@@ -496,25 +1142,53 @@ mlvpn_protocol_read(
         rlen -= crypto_PADSIZE;
     }
 #else
-    memcpy(decap_pkt->data, &proto.data, rlen);
+    memmove(pkt->data, &proto->data, rlen);
 #endif
-    decap_pkt->len = rlen;
-    decap_pkt->type = proto.flags;
-    if (proto.version >= 1) {
-        decap_pkt->reorder = proto.reorder;
-        decap_pkt->seq = be64toh(proto.data_seq);
-        mlvpn_loss_update(tun, decap_pkt->seq);
+    if (!compact) {
+        if (proto->flow_id != tun->peer_flow_id) {
+            /* new peer, or the peer restarted */
+            if (tun->peer_flow_id) {
+                rx_data_seq = 0;
+                if (reorder_buffer != NULL)
+                    mlvpn_rtun_reorder_drain(0);
+                mlvpn_fec_reset();
+                mlvpn_nack_reset();
+                mlvpn_dup_reset();
+            }
+            tun->peer_flow_id = proto->flow_id;
+            tun->peer_seq = proto->seq;
+        }
+        if (proto->flags == MLVPN_PKT_AUTH ||
+                proto->flags == MLVPN_PKT_AUTH_OK)
+            tun->peer_version = proto->version;
+    }
+    if (proto->seq > tun->peer_seq)
+        tun->peer_seq = proto->seq;
+    pkt->len = rlen;
+    pkt->type = proto->flags;
+    if (proto->version >= 1) {
+        pkt->reorder = proto->reorder;
+        pkt->seq = be64toh(proto->data_seq);
+        if (MLVPN_PKT_HAS_DATA_SEQ(pkt->type) &&
+                pkt->type != MLVPN_PKT_FEC && pkt->seq > rx_data_seq)
+            rx_data_seq = pkt->seq;
+        if (pkt->type == MLVPN_PKT_DATA)
+            mlvpn_loss_update(tun, pkt->seq);
     } else {
-        decap_pkt->reorder = 0;
-        decap_pkt->seq = 0;
+        pkt->reorder = 0;
+        pkt->seq = 0;
     }
-    if (proto.timestamp != (uint16_t)-1) {
-        tun->saved_timestamp = proto.timestamp;
+    if (proto->timestamp != (uint16_t)-1) {
+        double d = mlvpn_timestamp16_diff(
+            mlvpn_timestamp16(now64), proto->timestamp);
+        tun->saved_timestamp = proto->timestamp;
         tun->saved_timestamp_received_at = now64;
+        mlvpn_owd_update(tun, d);
+        mlvpn_cc_base_sample(&tun->owd_base, d);
     }
-    if (proto.timestamp_reply != (uint16_t)-1) {
+    if (proto->timestamp_reply != (uint16_t)-1) {
         uint16_t now16 = mlvpn_timestamp16(now64);
-        double R = mlvpn_timestamp16_diff(now16, proto.timestamp_reply);
+        double R = mlvpn_timestamp16_diff(now16, proto->timestamp_reply);
         if (R < 5000) { /* ignore large values, e.g. server was Ctrl-Zed */
             if (!tun->rtt_hit) { /* first measurement */
                 tun->srtt = R;
@@ -526,6 +1200,7 @@ mlvpn_protocol_read(
                 tun->rttvar = (1 - beta) * tun->rttvar + (beta * fabs(tun->srtt - R));
                 tun->srtt = (1 - alpha) * tun->srtt + (alpha * R);
             }
+            mlvpn_cc_base_sample(&tun->rtt_base, R);
         }
         log_debug("rtt", "%ums srtt %ums loss ratio: %d",
             (unsigned int)R, (unsigned int)tun->srtt, mlvpn_loss_ratio(tun));
@@ -535,84 +1210,349 @@ fail:
     return -1;
 }
 
-static int
-mlvpn_rtun_send(mlvpn_tunnel_t *tun, circular_buffer_t *pktbuf)
+/* Queue the parity packet of a complete group, on the tunnel which
+ * carried the fewest of its members */
+static void
+mlvpn_rtun_send_fec(mlvpn_tunnel_t *tun, mlvpn_pkt_t *pkt, uint64_t seq)
+{
+    mlvpn_pkt_t *parity = mlvpn_fec_tx_add(tun, pkt, seq);
+    mlvpn_tunnel_t *t, *dst = NULL;
+    uint64_t base;
+    uint32_t members, best = 0;
+
+    if (!parity)
+        return;
+    base = MLVPN_FEC_SEQ_BASE(parity->seq);
+    LIST_FOREACH(t, &rtuns, entries) {
+        if (t->wrr_slot < 0 || mlvpn_rtun_backlogged(t) ||
+                t->peer_version < 2)
+            continue;
+        members = t->fec_base == base ? t->fec_members : 0;
+        if (!dst || members < best || (members == best &&
+                mlvpn_pktbuffer_bytes(t->sbuf) <
+                mlvpn_pktbuffer_bytes(dst->sbuf))) {
+            dst = t;
+            best = members;
+        }
+    }
+    if (!dst) {
+        mlvpn_pkt_release(parity);
+        return;
+    }
+    mlvpn_pktbuffer_push(dst->sbuf, parity);
+    if (!ev_is_active(&dst->io_write) && !ev_is_active(&dst->io_pace))
+        ev_io_start(EV_A_ &dst->io_write);
+}
+
+/* Queue the copy of a duplicated packet on the second fastest tunnel */
+static void
+mlvpn_rtun_send_duplicate(mlvpn_tunnel_t *tun, mlvpn_pkt_t *pkt, uint64_t seq)
+{
+    mlvpn_tunnel_t *dst = mlvpn_rtun_choose_duplicate(tun);
+    if (dst)
+        mlvpn_rtun_send_hp(dst, mlvpn_dup_copy(pkt, seq));
+}
+
+/* Give a data packet its data_seq. The copies sent for duplication,
+ * parity and retransmission are taken now, before the encryption. */
+static uint64_t
+mlvpn_rtun_data_seq(mlvpn_tunnel_t *tun, mlvpn_pkt_t *pkt)
+{
+    uint64_t seq = data_seq++;
+    if (pkt->duplicate)
+        mlvpn_rtun_send_duplicate(tun, pkt, seq);
+    if (mlvpn_status.fec_group)
+        mlvpn_rtun_send_fec(tun, pkt, seq);
+    mlvpn_nack_cache(pkt, seq);
+    return seq;
+}
+
+/* Encapsulate (and encrypt) pkt in place, ready to be sent on tun.
+ * The wire header and the crypto MAC are written in the headroom in
+ * front of pkt->data, *wire points to the start of the datagram.
+ * Returns the number of bytes to write on the wire, or -1 on error.
+ */
+static ssize_t
+mlvpn_rtun_encap(mlvpn_tunnel_t *tun, mlvpn_pkt_t *pkt, mlvpn_proto_t **wire)
 {
     unsigned char nonce[crypto_NONCEBYTES];
     ssize_t ret;
     size_t wlen;
-    mlvpn_proto_t proto;
     uint64_t now64 = mlvpn_timestamp64(ev_now(EV_DEFAULT_UC));
-    memset(&proto, 0, sizeof(proto));
-    mlvpn_pkt_t *pkt = mlvpn_pktbuffer_read(pktbuf);
+    mlvpn_proto_t *proto;
+#ifdef ENABLE_CRYPTO
+    int encrypt = ! (mlvpn_options.cleartext_data &&
+        pkt->type == MLVPN_PKT_DATA);
+#else
+    int encrypt = 0;
+#endif
+
+    if (encrypt)
+        proto = (mlvpn_proto_t *)MLVPN_PKT_WIRE(pkt);
+    else
+        proto = (mlvpn_proto_t *)(pkt->data - MLVPN_PROTO_HDRSIZ);
+    *wire = proto;
+    memset(proto, 0, MLVPN_PROTO_HDRSIZ);
 
     pkt->reorder = 1;
     if (pkt->type == MLVPN_PKT_DATA && pkt->reorder) {
-        proto.data_seq = data_seq++;
-    }
-    wlen = PKTHDRSIZ(proto) + pkt->len;
-    proto.len = pkt->len;
-    proto.flags = pkt->type;
+        proto->data_seq = mlvpn_rtun_data_seq(tun, pkt);
+    } else if (pkt->type == MLVPN_PKT_FEC ||
+            pkt->type == MLVPN_PKT_RETRANSMIT ||
+            pkt->type == MLVPN_PKT_DUPLICATE ||
+            pkt->type == MLVPN_PKT_BUNDLE) {
+        proto->data_seq = pkt->seq;
+    }
+    wlen = MLVPN_PROTO_HDRSIZ + pkt->len;
+    proto->len = pkt->len;
+    proto->flags = pkt->type;
     if (pkt->reorder) {
-        proto.seq = tun->seq++;
+        proto->seq = tun->seq++;
     }
-    proto.flow_id = tun->flow_id;
-    proto.version = MLVPN_PROTOCOL_VERSION;
-    proto.reorder = pkt->reorder;
+    proto->flow_id = tun->flow_id;
+    /* full headers announce our version in AUTH packets only, see
+     * MLVPN_PROTOCOL_VERSION */
+    if (pkt->type == MLVPN_PKT_AUTH || pkt->type == MLVPN_PKT_AUTH_OK)
+        proto->version = MLVPN_PROTOCOL_VERSION;
+    else
+        proto->version = 1;
+    proto->reorder = pkt->reorder;
 
     /* we have a recent received timestamp */
     if (tun->saved_timestamp != -1) {
       if (now64 - tun->saved_timestamp_received_at < 1000 ) {
         /* send "corrected" timestamp advanced by how long we held it */
         /* Cast to uint16_t there intentional */
-        proto.timestamp_reply = tun->saved_timestamp + (now64 - tun->saved_timestamp_received_at);
+        proto->timestamp_reply = tun->saved_timestamp + (now64 - tun->saved_timestamp_received_at);
         tun->saved_timestamp = -1;
         tun->saved_timestamp_received_at = 0;
       } else {
-        proto.timestamp_reply = -1;
+        proto->timestamp_reply = -1;
         log_debug("rtt","(%s) No timestamp added, time too long! (%lu > 1000)",tun->name, tun->saved_timestamp + (now64 - tun->saved_timestamp_received_at ));
       }
     } else {
-      proto.timestamp_reply = -1;
+      proto->timestamp_reply = -1;
       log_debug("rtt","(%s) No timestamp added, time too long! (%lu > 1000)",tun->name, tun->saved_timestamp + (now64 - tun->saved_timestamp_received_at ));
     }
 
-    proto.timestamp = mlvpn_timestamp16(now64);
-#ifdef ENABLE_CRYPTO
-    if (mlvpn_options.cleartext_data && pkt->type == MLVPN_PKT_DATA) {
-        memcpy(&proto.data, &pkt->data, pkt->len);
-    } else {
-        if (wlen + crypto_PADSIZE > sizeof(proto.data)) {
-            log_warnx("protocol", "%s packet too long: %u/%d (packet=%d)",
-                tun->name,
-                (unsigned int)wlen + crypto_PADSIZE,
-                (unsigned int)sizeof(proto.data),
-                pkt->len);
-            return -1;
-        }
-        sodium_memzero(nonce, sizeof(nonce));
-        memcpy(nonce, &proto.seq, sizeof(proto.seq));
-        memcpy(nonce + sizeof(proto.seq), &proto.flow_id, sizeof(proto.flow_id));
-        if ((ret = crypto_encrypt((unsigned char *)&proto.data,
-                                  (const unsigned char *)&pkt->data, pkt->len,
-                                  nonce)) != 0) {
-            log_warnx("protocol", "%s crypto_encrypt failed: %d incorrect password?",
-                tun->name, (int)ret);
-            return -1;
-        }
-        proto.len += crypto_PADSIZE;
-        wlen += crypto_PADSIZE;
+    proto->timestamp = mlvpn_timestamp16(now64);
+#ifdef ENABLE_CRYPTO
+    if (encrypt) {
+        if (wlen + crypto_PADSIZE > sizeof(proto->data)) {
+            log_warnx("protocol", "%s packet too long: %u/%d (packet=%d)",
+                tun->name,
+                (unsigned int)wlen + crypto_PADSIZE,
+                (unsigned int)sizeof(proto->data),
+                pkt->len);
+            return -1;
+        }
+        sodium_memzero(nonce, sizeof(nonce));
+        memcpy(nonce, &proto->seq, sizeof(proto->seq));
+        memcpy(nonce + sizeof(proto->seq), &proto->flow_id, sizeof(proto->flow_id));
+        /* proto->data is crypto_PADSIZE bytes before pkt->data: the
+         * MAC fills the gap and the payload is encrypted in place */
+        if ((ret = crypto_encrypt((unsigned char *)&proto->data,
+                                  (const unsigned char *)&pkt->data, pkt->len,
+                                  nonce)) != 0) {
+            log_warnx("protocol", "%s crypto_encrypt failed: %d incorrect password?",
+                tun->name, (int)ret);
+            return -1;
+        }
+        proto->len += crypto_PADSIZE;
+        wlen += crypto_PADSIZE;
+    }
+#endif
+    if (tun->peer_version >= 2 && proto->version < 2)
+        return mlvpn_proto_compact(proto, wlen, wire);
+    proto->len = htobe16(proto->len);
+    proto->seq = htobe64(proto->seq);
+    proto->data_seq = htobe64(proto->data_seq);
+    proto->flow_id = htobe32(proto->flow_id);
+    proto->timestamp = htobe16(proto->timestamp);
+    proto->timestamp_reply = htobe16(proto->timestamp_reply);
+    return wlen;
+}
+
+/* Account for a datagram of len bytes successfully sent on tun */
+static void
+mlvpn_rtun_sent(mlvpn_tunnel_t *tun, ssize_t len)
+{
+    tun->sentpackets++;
+    tun->sentbytes += len;
+    if (tun->quota) {
+      tun->permitted -= len;
+    }
+}
+
+/* Pacing
+ * Data packets of a paced tunnel leave at pace_rate: every packet
+ * pushes pace_next by its transmission time, and the tunnel sleeps on
+ * its io_pace timer until pace_next, minus a small burst quantum. High
+ * priority packets are never paced.
+ */
+static void
+mlvpn_rtun_pace_update(mlvpn_tunnel_t *t)
+{
+    uint32_t capacity = t->bandwidth ? t->bandwidth : t->bandwidth_probe;
+    if (!t->pacing)
+        t->pace_rate = 0;
+    else if (t->cc_rate > 0 && (capacity == 0 || t->cc_rate < capacity))
+        t->pace_rate = t->cc_rate;
+    else
+        t->pace_rate = capacity * MLVPN_PACE_GAIN;
+}
+
+/* Seconds before the next data packet may leave */
+static double
+mlvpn_rtun_pace_wait(mlvpn_tunnel_t *t)
+{
+    double wait;
+    if (t->pace_rate <= 0)
+        return 0;
+    wait = t->pace_next - ev_now(EV_DEFAULT_UC) - MLVPN_PACE_QUANTUM;
+    return wait > 0 ? wait : 0;
+}
+
+/* A data packet of len bytes was handed to the kernel */
+static void
+mlvpn_rtun_pace_sent(mlvpn_tunnel_t *t, size_t len)
+{
+    ev_tstamp now = ev_now(EV_DEFAULT_UC);
+    if (t->pace_rate <= 0)
+        return;
+    if (t->pace_next < now)
+        t->pace_next = now;
+    t->pace_next += (len + IP4_UDP_OVERHEAD) / t->pace_rate;
+}
+
+/* Returns 1 if data packets must wait, the pacing timer is armed */
+static int
+mlvpn_rtun_pace_defer(mlvpn_tunnel_t *t)
+{
+    double wait = mlvpn_rtun_pace_wait(t);
+    if (wait <= 0)
+        return 0;
+    if (!ev_is_active(&t->io_pace)) {
+        ev_timer_set(&t->io_pace, wait, 0.);
+        ev_timer_start(EV_A_ &t->io_pace);
+        t->pace_deferred++;
+    }
+    return 1;
+}
+
+static void
+mlvpn_rtun_pace_timeout(EV_P_ ev_timer *w, int revents)
+{
+    mlvpn_tunnel_t *t = w->data;
+    if (!ev_is_active(&t->io_write) && t->status >= MLVPN_AUTHOK &&
+            !mlvpn_cb_is_empty(t->sbuf)) {
+        ev_io_start(EV_A_ &t->io_write);
+    }
+}
+
+/* Bundling
+ * The data packets queued in the send buffer are packed together into a
+ * single MLVPN_PKT_BUNDLE packet, up to the tunnel MTU: one header, one
+ * MAC and one system call for all of them. With a bundle_delay, a send
+ * buffer holding too few bytes waits on the io_bundle timer for more
+ * packets, at most bundle_delay. High priority packets are never
+ * bundled.
+ */
+
+/* Returns 1 if data packets wait for others to fill a bundle, the
+ * bundle timer is armed */
+static int
+mlvpn_rtun_bundle_defer(mlvpn_tunnel_t *t)
+{
+    uint32_t len;
+    if (!t->bundle || !t->bundle_delay || t->bundle_expired ||
+            t->peer_version < 2)
+        return 0;
+    len = mlvpn_pktbuffer_bytes(t->sbuf) +
+        mlvpn_cb_count(t->sbuf) * MLVPN_BUNDLE_HDRSIZ;
+    if (len + MLVPN_BUNDLE_HDRSIZ + MLVPN_BUNDLE_SMALL >
+            (uint32_t)mlvpn_options.mtu)
+        return 0;
+    if (!ev_is_active(&t->io_bundle)) {
+        ev_timer_set(&t->io_bundle, t->bundle_delay / 1000.0, 0.);
+        ev_timer_start(EV_A_ &t->io_bundle);
+    }
+    return 1;
+}
+
+static void
+mlvpn_rtun_bundle_timeout(EV_P_ ev_timer *w, int revents)
+{
+    mlvpn_tunnel_t *t = w->data;
+    t->bundle_expired = 1;
+    if (!ev_is_active(&t->io_write) && t->status >= MLVPN_AUTHOK &&
+            !mlvpn_cb_is_empty(t->sbuf)) {
+        ev_io_start(EV_A_ &t->io_write);
+    }
+}
+
+/* Can the next packet of sbuf be added to a bundle of len bytes */
+static int
+mlvpn_rtun_bundle_next(circular_buffer_t *sbuf, uint32_t len)
+{
+    mlvpn_pkt_t *next;
+    if (mlvpn_cb_is_empty(sbuf))
+        return 0;
+    next = mlvpn_pktbuffer_read_norelease(sbuf);
+    return next->type == MLVPN_PKT_DATA &&
+        len + MLVPN_BUNDLE_HDRSIZ + next->len <= (uint32_t)mlvpn_options.mtu;
+}
+
+/* Dequeue the next packet of the send buffer, bundled with the data
+ * packets behind it when they fit */
+static mlvpn_pkt_t *
+mlvpn_rtun_read_data(mlvpn_tunnel_t *tun)
+{
+    mlvpn_pkt_t *bundle, *pkt = mlvpn_pktbuffer_read(tun->sbuf);
+    uint16_t len;
+
+    /* version 1 peers don't know bundles */
+    if (!tun->bundle || tun->peer_version < 2)
+        return pkt;
+    ev_timer_stop(EV_A_ &tun->io_bundle);
+    tun->bundle_expired = 0;
+    if (pkt->type != MLVPN_PKT_DATA || !mlvpn_rtun_bundle_next(tun->sbuf,
+            MLVPN_BUNDLE_HDRSIZ + pkt->len))
+        return pkt;
+    bundle = mlvpn_pkt_alloc();
+    bundle->type = MLVPN_PKT_BUNDLE;
+    /* members take consecutive data_seq, starting with this one */
+    bundle->seq = data_seq;
+    for (;;) {
+        mlvpn_rtun_data_seq(tun, pkt);
+        len = htobe16(pkt->len);
+        memcpy(bundle->data + bundle->len, &len, sizeof(len));
+        memcpy(bundle->data + bundle->len + sizeof(len), pkt->data, pkt->len);
+        bundle->len += sizeof(len) + pkt->len;
+        tun->bundled++;
+        mlvpn_pkt_release(pkt);
+        if (!mlvpn_rtun_bundle_next(tun->sbuf, bundle->len))
+            break;
+        pkt = mlvpn_pktbuffer_read(tun->sbuf);
     }
-#else
-    memcpy(&proto.data, &pkt->data, pkt->len);
-#endif
-    proto.len = htobe16(proto.len);
-    proto.seq = htobe64(proto.seq);
-    proto.data_seq = htobe64(proto.data_seq);
-    proto.flow_id = htobe32(proto.flow_id);
-    proto.timestamp = htobe16(proto.timestamp);
-    proto.timestamp_reply = htobe16(proto.timestamp_reply);
-    ret = sendto(tun->fd, &proto, wlen, MSG_DONTWAIT,
+    return bundle;
+}
+
+static int
+mlvpn_rtun_send(mlvpn_tunnel_t *tun, circular_buffer_t *pktbuf)
+{
+    ssize_t ret;
+    ssize_t wlen;
+    mlvpn_proto_t *proto;
+    mlvpn_pkt_t *pkt = pktbuf == tun->sbuf ?
+        mlvpn_rtun_read_data(tun) : mlvpn_pktbuffer_read(pktbuf);
+
+    wlen = mlvpn_rtun_encap(tun, pkt, &proto);
+    if (wlen < 0) {
+        mlvpn_pkt_release(pkt);
+        return -1;
+    }
+    ret = sendto(tun->fd, proto, wlen, MSG_DONTWAIT,
                  tun->addrinfo->ai_addr, tun->addrinfo->ai_addrlen);
     if (ret < 0)
     {
@@ -621,12 +1561,7 @@ mlvpn_rtun_send(mlvpn_tunnel_t *tun, circular_buffer_t *pktbuf)
             mlvpn_rtun_status_down(tun);
         }
     } else {
-        tun->sentpackets++;
-        tun->sentbytes += ret;
-        if (tun->quota) {
-          tun->permitted -= ret;
-        }
-
+        mlvpn_rtun_sent(tun, ret);
         if (wlen != ret)
         {
             log_warnx("net", "%s write error %d/%u",
@@ -636,6 +1571,7 @@ mlvpn_rtun_send(mlvpn_tunnel_t *tun, circular_buffer_t *pktbuf)
                 tun->name, (int)ret, pkt->len, pkt->type, pkt->seq, pkt->reorder);
         }
     }
+    mlvpn_pkt_release(pkt);
 
     if (ev_is_active(&tun->io_write) && mlvpn_cb_is_empty(pktbuf)) {
         ev_io_stop(EV_A_ &tun->io_write);
@@ -643,17 +1579,237 @@ mlvpn_rtun_send(mlvpn_tunnel_t *tun, circular_buffer_t *pktbuf)
     return ret;
 }
 
+#ifdef HAVE_SENDMMSG
+/* Encapsulate as many queued packets as the batch can hold.
+ * High priority packets always go first.
+ */
+static void
+mlvpn_rtun_batch_fill(mlvpn_tunnel_t *tun)
+{
+    struct mlvpn_txbatch *batch = tun->txbatch;
+    circular_buffer_t *pktbuf;
+    mlvpn_pkt_t *pkt;
+    ssize_t wlen;
+    int max = tun->send_batch;
+
+    if (max > MLVPN_BATCH_MAX)
+        max = MLVPN_BATCH_MAX;
+    batch->count = batch->sent = 0;
+    while (batch->count < max) {
+        if (! mlvpn_cb_is_empty(tun->hpsbuf))
+            pktbuf = tun->hpsbuf;
+        else if (! mlvpn_cb_is_empty(tun->sbuf) &&
+                mlvpn_rtun_pace_wait(tun) <= 0 &&
+                ! mlvpn_rtun_bundle_defer(tun))
+            pktbuf = tun->sbuf;
+        else
+            break;
+        pkt = pktbuf == tun->sbuf ?
+            mlvpn_rtun_read_data(tun) : mlvpn_pktbuffer_read(pktbuf);
+        wlen = mlvpn_rtun_encap(tun, pkt, &batch->wire[batch->count]);
+        if (wlen < 0) {
+            mlvpn_pkt_release(pkt);
+            continue;
+        }
+        if (pktbuf == tun->sbuf)
+            mlvpn_rtun_pace_sent(tun, wlen);
+        batch->pkts[batch->count] = pkt;
+        batch->len[batch->count] = wlen;
+        batch->count++;
+    }
+}
+
+/* Number of datagrams, starting at iov, that can be sent as a single
+ * UDP GSO message: a run of same-size datagrams, optionally terminated
+ * by a shorter one, as required by UDP_SEGMENT.
+ */
+static int
+mlvpn_rtun_gso_segs(mlvpn_tunnel_t *tun, struct iovec *iov, int n)
+{
+    size_t size = iov[0].iov_len;
+    size_t total = size;
+    int i;
+
+    if (! tun->udp_gso)
+        return 1;
+    for (i = 1; i < n && i < MLVPN_GSO_MAXSEGS; i++) {
+        if (iov[i].iov_len > size ||
+                total + iov[i].iov_len > MLVPN_GSO_MAXBYTES)
+            break;
+        total += iov[i].iov_len;
+        if (iov[i].iov_len < size) {
+            i++;
+            break;
+        }
+    }
+    return i;
+}
+
+/* Send the pending part of the batch with a single sendmmsg(2) call.
+ * With UDP GSO, runs of same-size datagrams share one message and are
+ * segmented by the kernel.
+ * Datagrams the kernel did not accept stay in the batch and are sent
+ * on the next EV_WRITE event.
+ * Returns -1 if sendmmsg is not implemented by the running kernel.
+ */
+static int
+mlvpn_rtun_batch_flush(mlvpn_tunnel_t *tun)
+{
+    struct mlvpn_txbatch *batch = tun->txbatch;
+    struct mmsghdr msgs[MLVPN_BATCH_MAX];
+    struct iovec iovs[MLVPN_BATCH_MAX];
+    int segs[MLVPN_BATCH_MAX];
+#ifdef UDP_SEGMENT
+    union {
+        char buf[CMSG_SPACE(sizeof(uint16_t))];
+        struct cmsghdr align;
+    } ctrl[MLVPN_BATCH_MAX];
+    struct cmsghdr *cmsg;
+    uint16_t gso_size;
+#endif
+    size_t msglen;
+    int i, j, k, n, nmsg, ret;
+
+    n = batch->count - batch->sent;
+    for (i = 0; i < n; i++) {
+        iovs[i].iov_base = batch->wire[batch->sent + i];
+        iovs[i].iov_len = batch->len[batch->sent + i];
+    }
+    for (i = 0, nmsg = 0; i < n; i += segs[nmsg++]) {
+        segs[nmsg] = mlvpn_rtun_gso_segs(tun, &iovs[i], n - i);
+        memset(&msgs[nmsg].msg_hdr, 0, sizeof(msgs[nmsg].msg_hdr));
+        msgs[nmsg].msg_hdr.msg_iov = &iovs[i];
+        msgs[nmsg].msg_hdr.msg_iovlen = segs[nmsg];
+        msgs[nmsg].msg_hdr.msg_name = tun->addrinfo->ai_addr;
+        msgs[nmsg].msg_hdr.msg_namelen = tun->addrinfo->ai_addrlen;
+#ifdef UDP_SEGMENT
+        if (segs[nmsg] > 1) {
+            msgs[nmsg].msg_hdr.msg_control = ctrl[nmsg].buf;
+            msgs[nmsg].msg_hdr.msg_controllen = sizeof(ctrl[nmsg].buf);
+            cmsg = CMSG_FIRSTHDR(&msgs[nmsg].msg_hdr);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(gso_size));
+            gso_size = iovs[i].iov_len;
+            memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+        }
+#endif
+    }
+    ret = sendmmsg(tun->fd, msgs, nmsg, MSG_DONTWAIT);
+    if (ret < 0) {
+        if (errno == ENOSYS)
+            return -1;
+        if (segs[0] > 1 && (errno == EIO || errno == EINVAL)) {
+            /* egress device without checksum offload, or a kernel
+             * refusing the segment size: retry without GSO */
+            log_warn("net", "%s UDP GSO send failed, GSO disabled",
+                tun->name);
+            tun->udp_gso = 0;
+            return 0;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            log_warn("net", "%s write error", tun->name);
+            mlvpn_rtun_status_down(tun);
+        }
+        return 0;
+    }
+    for (i = 0, j = 0; i < ret; i++) {
+        msglen = 0;
+        for (k = j; k < j + segs[i]; k++) {
+            mlvpn_rtun_sent(tun, iovs[k].iov_len);
+            msglen += iovs[k].iov_len;
+            mlvpn_pkt_release(batch->pkts[batch->sent + k]);
+        }
+        if (msgs[i].msg_len != msglen) {
+            log_warnx("net", "%s write error %u/%u",
+                tun->name, msgs[i].msg_len, (unsigned int)msglen);
+        }
+        j += segs[i];
+    }
+    batch->sent += j;
+    log_debug("net", "> %s sent %d/%d datagrams in %d/%d messages",
+        tun->name, j, n, ret, nmsg);
+    return j;
+}
+
+#endif
+
+/* Give the packets of the batch not sent yet back to the pool */
+static void
+mlvpn_rtun_batch_reset(mlvpn_tunnel_t *tun)
+{
+    struct mlvpn_txbatch *batch = tun->txbatch;
+    if (! batch)
+        return;
+    while (batch->sent < batch->count)
+        mlvpn_pkt_release(batch->pkts[batch->sent++]);
+    batch->count = batch->sent = 0;
+}
+
+#ifdef HAVE_SENDMMSG
+static void
+mlvpn_rtun_write_batch(mlvpn_tunnel_t *tun)
+{
+    if (! tun->txbatch) {
+        tun->txbatch = calloc(1, sizeof(struct mlvpn_txbatch));
+        if (! tun->txbatch)
+            fatal(NULL, "calloc failed");
+        mlvpn_pkt_pool_reserve(MLVPN_BATCH_MAX);
+    }
+    if (tun->txbatch->sent >= tun->txbatch->count) {
+        mlvpn_rtun_batch_fill(tun);
+    }
+    if (tun->txbatch->count > tun->txbatch->sent &&
+            mlvpn_rtun_batch_flush(tun) < 0) {
+        log_warnx("net", "%s sendmmsg not supported, send_batch disabled",
+            tun->name);
+        tun->send_batch = 1;
+        mlvpn_rtun_batch_reset(tun);
+        return;
+    }
+    if (ev_is_active(&tun->io_write) &&
+            tun->txbatch->sent >= tun->txbatch->count &&
+            mlvpn_cb_is_empty(tun->hpsbuf) &&
+            (mlvpn_cb_is_empty(tun->sbuf) || mlvpn_rtun_pace_defer(tun) ||
+             mlvpn_rtun_bundle_defer(tun))) {
+        ev_io_stop(EV_A_ &tun->io_write);
+    }
+}
+#endif
 
 static void
 mlvpn_rtun_write(EV_P_ ev_io *w, int revents)
 {
     mlvpn_tunnel_t *tun = w->data;
+    ssize_t ret;
+#ifdef HAVE_SENDMMSG
+    /* flush what is left of a previous batch even if batching has
+     * been disabled in the meantime */
+    if (tun->send_batch > 1 ||
+            (tun->txbatch && tun->txbatch->sent < tun->txbatch->count)) {
+        mlvpn_rtun_write_batch(tun);
+        if (mlvpn_cb_count(tun->sbuf) < MLVPN_SBUF_LOWWATER) {
+            mlvpn_rtun_wrr_drained(tun);
+            mlvpn_tuntap_resume();
+        }
+        return;
+    }
+#endif
     if (! mlvpn_cb_is_empty(tun->hpsbuf)) {
         mlvpn_rtun_send(tun, tun->hpsbuf);
     }
 
     if (! mlvpn_cb_is_empty(tun->sbuf)) {
-        mlvpn_rtun_send(tun, tun->sbuf);
+        if (mlvpn_rtun_pace_defer(tun) || mlvpn_rtun_bundle_defer(tun)) {
+            if (mlvpn_cb_is_empty(tun->hpsbuf))
+                ev_io_stop(EV_A_ &tun->io_write);
+        } else if ((ret = mlvpn_rtun_send(tun, tun->sbuf)) > 0) {
+            mlvpn_rtun_pace_sent(tun, ret);
+        }
+    }
+    if (mlvpn_cb_count(tun->sbuf) < MLVPN_SBUF_LOWWATER) {
+        mlvpn_rtun_wrr_drained(tun);
+        mlvpn_tuntap_resume();
     }
 }
 
@@ -693,6 +1849,7 @@ mlvpn_rtun_new(const char *name,
     new->fd = -1;
     new->server_mode = server_mode;
     new->weight = 1;
+    new->wrr_slot = -1;
     new->status = MLVPN_DISCONNECTED;
     new->addrinfo = NULL;
     new->sentpackets = 0;
@@ -711,12 +1868,17 @@ mlvpn_rtun_new(const char *name,
     new->srtt = 1000;
     new->rttvar = 500;
     new->rtt_hit = 0;
+    new->owd_hit = 0;
     new->seq_last = 0;
     new->seq_vect = (uint64_t) -1;
     new->flow_id = crypto_nonce_random();
     new->bandwidth = bandwidth;
     new->fallback_only = fallback_only;
     new->loss_tolerence = loss_tolerence;
+    new->probe_interval = MLVPN_PROBE_INTERVAL;
+    new->cc_target = MLVPN_CC_TARGET;
+    new->recv_batch = 1;
+    new->send_batch = 1;
     if (bindaddr)
         strlcpy(new->bindaddr, bindaddr, sizeof(new->bindaddr));
     if (bindport)
@@ -739,6 +1901,12 @@ mlvpn_rtun_new(const char *name,
     ev_init(&new->io_write, mlvpn_rtun_write);
     ev_timer_init(&new->io_timeout, mlvpn_rtun_check_timeout,
         0., MLVPN_IO_TIMEOUT_DEFAULT);
+    new->io_pace.data = new;
+    ev_init(&new->io_pace, mlvpn_rtun_pace_timeout);
+    new->io_bundle.data = new;
+    ev_init(&new->io_bundle, mlvpn_rtun_bundle_timeout);
+    new->io_liveness.data = new;
+    ev_init(&new->io_liveness, mlvpn_rtun_check_liveness);
     ev_timer_start(EV_A_ &new->io_timeout);
     update_process_title();
     return new;
@@ -764,6 +1932,11 @@ mlvpn_rtun_drop(mlvpn_tunnel_t *t)
                 freeaddrinfo(tmp->addrinfo);
             mlvpn_pktbuffer_free(tmp->sbuf);
             mlvpn_pktbuffer_free(tmp->hpsbuf);
+            if (tmp->txbatch) {
+                mlvpn_rtun_batch_reset(tmp);
+                free(tmp->txbatch);
+                mlvpn_pkt_pool_unreserve(MLVPN_BATCH_MAX);
+            }
             /* Safety */
             tmp->name = NULL;
             break;
@@ -805,6 +1978,43 @@ mlvpn_rtun_recalc_weight_srtt()
     }
 }
 
+/* Too many packets wait in the send buffer of the tunnel */
+int
+mlvpn_rtun_backlogged(mlvpn_tunnel_t *t)
+{
+  return mlvpn_cb_count(t->sbuf) >= MLVPN_SBUF_HIGHWATER;
+}
+
+/* Every tunnel in aggregation is backlogged: nowhere to send a packet
+ * read from the tunnel interface without growing a queue */
+int
+mlvpn_rtun_all_backlogged()
+{
+  mlvpn_tunnel_t *t;
+  int usable = 0;
+  LIST_FOREACH(t, &rtuns, entries) {
+    if (t->wrr_slot < 0)
+      continue;
+    if (!mlvpn_rtun_backlogged(t))
+      return 0;
+    usable++;
+  }
+  return usable > 0;
+}
+
+/* Upload bandwidth of the tunnel in bytes per second: the configured
+ * bandwidth_upload, or the capacity measured by the probes, lowered to
+ * the congestion control rate. 0 if unknown.
+ */
+uint32_t
+mlvpn_rtun_bandwidth(mlvpn_tunnel_t *t)
+{
+  uint32_t bw = t->bandwidth ? t->bandwidth : t->bandwidth_probe;
+  if (t->cc_rate > 0 && (bw == 0 || t->cc_rate < bw))
+    bw = t->cc_rate;
+  return bw;
+}
+
 /* Based on tunnel bandwidth, compute a "weight" value
  * to balance correctly the round robin rtun_choose.
  */
@@ -817,9 +2027,9 @@ mlvpn_rtun_recalc_weight_bw()
 
   LIST_FOREACH(t, &rtuns, entries)
   {
-    if (t->bandwidth == 0)
+    if (mlvpn_rtun_bandwidth(t) == 0)
       unset++;
-    bandwidth_total += t->bandwidth;
+    bandwidth_total += mlvpn_rtun_bandwidth(t);
   }
   if (unset) {
     return mlvpn_rtun_recalc_weight_srtt();
@@ -827,12 +2037,12 @@ mlvpn_rtun_recalc_weight_bw()
     LIST_FOREACH(t, &rtuns, entries)
     {
       /* useless, but we want to be sure not to divide by 0 ! */
-      if (t->bandwidth > 0 && bandwidth_total > 0)
+      if (mlvpn_rtun_bandwidth(t) > 0 && bandwidth_total > 0)
       {
-        mlvpn_rtun_set_weight(t, (((double)t->bandwidth /
+        mlvpn_rtun_set_weight(t, (((double)mlvpn_rtun_bandwidth(t) /
                                    (double)bandwidth_total) * 100.0));
         log_debug("wrr", "%s weight = %f (%u %u)", t->name, t->weight,
-                  t->bandwidth, bandwidth_total);
+                  mlvpn_rtun_bandwidth(t), bandwidth_total);
       }
     }
   }   
@@ -853,16 +2063,16 @@ mlvpn_rtun_recalc_weight_prio()
   double bw=bwneeded;
   LIST_FOREACH(t, &rtuns, entries) {
     if ((t->quota == 0) && (t->status >= MLVPN_AUTHOK)) {
-      mlvpn_rtun_set_weight(t, (t->bandwidth*80) / bwneeded);
-      bw-=(t->bandwidth*0.8);
+      mlvpn_rtun_set_weight(t, (mlvpn_rtun_bandwidth(t)*80) / bwneeded);
+      bw-=(mlvpn_rtun_bandwidth(t)*0.8);
     } else {
-    if (bw>0 && (t->quota==0 || t->permitted > (t->bandwidth*3)) && (t->status >= MLVPN_AUTHOK)) {
-      if (t->bandwidth*0.8 > bw) {
+    if (bw>0 && (t->quota==0 || mlvpn_rtun_tokens(t) >= mlvpn_rtun_quota_burst(t) / 2) && (t->status >= MLVPN_AUTHOK)) {
+      if (mlvpn_rtun_bandwidth(t)*0.8 > bw) {
         mlvpn_rtun_set_weight(t, (bw*100) / bwneeded);
       } else {
-        mlvpn_rtun_set_weight(t, (t->bandwidth*80) / bwneeded);
+        mlvpn_rtun_set_weight(t, (mlvpn_rtun_bandwidth(t)*80) / bwneeded);
       }
-      bw-=(t->bandwidth*0.8);
+      bw-=(mlvpn_rtun_bandwidth(t)*0.8);
     } else {
       mlvpn_rtun_set_weight(t, 0);
     }
@@ -920,6 +2130,53 @@ mlvpn_rtun_bind(mlvpn_tunnel_t *t)
     return 0;
 }
 
+/* Enable or disable UDP GSO/GRO on the tunnel socket according to
+ * t->udp_offload. Options refused by the kernel are left disabled.
+ */
+void
+mlvpn_rtun_set_offload(mlvpn_tunnel_t *t)
+{
+#if defined(UDP_SEGMENT) && defined(UDP_GRO)
+    int val;
+
+    if (t->fd < 0) {
+        t->udp_gso = t->udp_gro = 0;
+        return;
+    }
+    if (t->udp_gro && ! t->udp_offload) {
+        val = 0;
+        if (setsockopt(t->fd, SOL_UDP, UDP_GRO, &val, sizeof(val)) < 0)
+            log_warn("net", "%s setsockopt UDP_GRO failed", t->name);
+    }
+    t->udp_gso = t->udp_gro = 0;
+    if (! t->udp_offload)
+        return;
+#ifdef HAVE_SENDMMSG
+    /* segment size is given per message, this only probes for support */
+    val = 0;
+    if (setsockopt(t->fd, SOL_UDP, UDP_SEGMENT, &val, sizeof(val)) < 0) {
+        log_warn("net", "%s UDP_SEGMENT not supported, GSO disabled",
+            t->name);
+    } else {
+        t->udp_gso = 1;
+    }
+#endif
+#ifdef HAVE_RECVMMSG
+    val = 1;
+    if (setsockopt(t->fd, SOL_UDP, UDP_GRO, &val, sizeof(val)) < 0) {
+        log_warn("net", "%s UDP_GRO not supported, GRO disabled",
+            t->name);
+    } else {
+        t->udp_gro = 1;
+    }
+#endif
+    log_debug("net", "%s UDP offload: gso=%d gro=%d",
+        t->name, t->udp_gso, t->udp_gro);
+#else
+    t->udp_gso = t->udp_gro = 0;
+#endif
+}
+
 static int
 mlvpn_rtun_start(mlvpn_tunnel_t *t)
 {
@@ -999,6 +2256,7 @@ mlvpn_rtun_start(mlvpn_tunnel_t *t)
 
     /* set non blocking after connect... May lockup the entiere process */
     mlvpn_sock_set_nonblocking(fd);
+    mlvpn_rtun_set_offload(t);
     mlvpn_rtun_tick(t);
     ev_io_set(&t->io_read, fd, EV_READ);
     ev_io_set(&t->io_write, fd, EV_WRITE);
@@ -1085,11 +2343,15 @@ mlvpn_rtun_status_up(mlvpn_tunnel_t *t)
     ev_tstamp now = ev_now(EV_DEFAULT_UC);
     t->status = MLVPN_AUTHOK;
     t->next_keepalive = NEXT_KEEPALIVE(now, t);
+    t->next_probe = now + 1;
     t->last_activity = now;
     t->last_keepalive_ack = now;
     t->last_keepalive_ack_sent = now;
+    mlvpn_rtun_set_liveness(t);
     mlvpn_update_status();
     mlvpn_rtun_wrr_reset(&rtuns, mlvpn_status.fallback_mode);
+    /* an empty tunnel joined the aggregation */
+    mlvpn_tuntap_resume();
     mlvpn_script_get_env(&env_len, &env);
     priv_run_script(3, cmdargs, env_len, env);
     if (mlvpn_status.connected > 0 && mlvpn_status.initialized == 0) {
@@ -1107,6 +2369,78 @@ mlvpn_rtun_status_up(mlvpn_tunnel_t *t)
     update_process_title();
 }
 
+/* A tunnel in aggregation other than t, with room in its high priority
+ * (hp) or normal send buffer: first if it can, any other one otherwise */
+static mlvpn_tunnel_t *
+mlvpn_rtun_requeue_dst(mlvpn_tunnel_t *t, mlvpn_tunnel_t *first, int hp)
+{
+    mlvpn_tunnel_t *u;
+    if (first && first != t &&
+            ! mlvpn_cb_is_full(hp ? first->hpsbuf : first->sbuf))
+        return first;
+    LIST_FOREACH(u, &rtuns, entries) {
+        if (u->wrr_slot < 0 || u == t)
+            continue;
+        if (! mlvpn_cb_is_full(hp ? u->hpsbuf : u->sbuf))
+            return u;
+    }
+    return NULL;
+}
+
+/* Move the packets waiting on a tunnel leaving the aggregation (down or
+ * lossy) to the tunnels still in it. Data packets go through the
+ * scheduler: they were not encapsulated yet, so they take fresh
+ * sequence numbers on their new tunnel. High priority packets go to the
+ * high priority buffer of the fastest tunnel. Retransmits, duplicates
+ * and parity packets keep their data_seq. Packets stay where they are
+ * once every other tunnel is full.
+ */
+static void
+mlvpn_rtun_requeue(mlvpn_tunnel_t *t)
+{
+    circular_buffer_t *bufs[2] = {t->hpsbuf, t->sbuf};
+    mlvpn_tunnel_t *dst;
+    mlvpn_pkt_t *pkt;
+    int i, hp, moved = 0, left;
+
+    for (i = 0; i < 2; i++) {
+        hp = bufs[i] == t->hpsbuf;
+        while (! mlvpn_cb_is_empty(bufs[i])) {
+            pkt = mlvpn_pktbuffer_read_norelease(bufs[i]);
+            if (pkt->type != MLVPN_PKT_DATA &&
+                    pkt->type != MLVPN_PKT_RETRANSMIT &&
+                    pkt->type != MLVPN_PKT_DUPLICATE &&
+                    pkt->type != MLVPN_PKT_FEC) {
+                /* keepalives, probes... belong to this tunnel */
+                mlvpn_pkt_release(mlvpn_pktbuffer_read(bufs[i]));
+                continue;
+            }
+            dst = mlvpn_rtun_requeue_dst(t, hp ? mlvpn_rtun_fastest() :
+                mlvpn_rtun_choose(pkt->len), hp);
+            if (! dst)
+                break;
+            pkt = mlvpn_pktbuffer_read(bufs[i]);
+            if (hp) {
+                mlvpn_pktbuffer_push(dst->hpsbuf, pkt);
+                if (! ev_is_active(&dst->io_write))
+                    ev_io_start(EV_A_ &dst->io_write);
+            } else {
+                mlvpn_pktbuffer_push(dst->sbuf, pkt);
+                if (mlvpn_rtun_all_backlogged())
+                    mlvpn_tuntap_pause();
+                if (! ev_is_active(&dst->io_write) &&
+                        ! ev_is_active(&dst->io_pace))
+                    ev_io_start(EV_A_ &dst->io_write);
+            }
+            moved++;
+        }
+    }
+    left = mlvpn_cb_count(t->hpsbuf) + mlvpn_cb_count(t->sbuf);
+    if (moved || left)
+        log_info("protocol", "%s %d packets moved to other tunnels, "
+            "%d could not be moved", t->name, moved, left);
+}
+
 void
 mlvpn_rtun_status_down(mlvpn_tunnel_t *t)
 {
@@ -1116,11 +2450,19 @@ mlvpn_rtun_status_down(mlvpn_tunnel_t *t)
     enum chap_status old_status = t->status;
     t->status = MLVPN_DISCONNECTED;
     t->disconnects++;
-    mlvpn_pktbuffer_reset(t->sbuf);
-    mlvpn_pktbuffer_reset(t->hpsbuf);
+    /* encapsulated for this tunnel, they can't go anywhere else */
+    mlvpn_rtun_batch_reset(t);
     if (ev_is_active(&t->io_write)) {
         ev_io_stop(EV_A_ &t->io_write);
     }
+    ev_timer_stop(EV_A_ &t->io_pace);
+    ev_timer_stop(EV_A_ &t->io_bundle);
+    ev_timer_stop(EV_A_ &t->io_liveness);
+    t->liveness_lost = 0;
+    mlvpn_tuntap_resume();
+    /* the link may come back through another path */
+    t->rtt_base.len = t->rtt_base.cur_hit = 0;
+    t->owd_base.len = t->owd_base.cur_hit = 0;
 
     mlvpn_update_status();
     if (old_status >= MLVPN_AUTHOK)
@@ -1129,6 +2471,7 @@ mlvpn_rtun_status_down(mlvpn_tunnel_t *t)
         priv_run_script(3, cmdargs, env_len, env);
         /* Re-initialize weight round robin */
         mlvpn_rtun_wrr_reset(&rtuns, mlvpn_status.fallback_mode);
+        mlvpn_rtun_requeue(t);
         if (mlvpn_status.connected == 0 && mlvpn_status.initialized == 1) {
             cmdargs[0] = tuntap.devname;
             cmdargs[1] = "tuntap_down";
@@ -1137,11 +2480,20 @@ mlvpn_rtun_status_down(mlvpn_tunnel_t *t)
             mlvpn_status.initialized = 0;
         }
         mlvpn_free_script_env(env);
-        if (reorder_buffer != NULL) {
+        /* while other tunnels are up the reorder buffer is kept: the
+         * holes left by this one are skipped as they time out */
+        if (reorder_buffer != NULL && mlvpn_status.connected == 0) {
             mlvpn_rtun_reorder_drain(0);
             mlvpn_reorder_reset(reorder_buffer);
         }
+        if (mlvpn_status.connected == 0) {
+            mlvpn_fec_reset();
+            mlvpn_nack_reset();
+            mlvpn_dup_reset();
+        }
     }
+    mlvpn_pktbuffer_reset(t->sbuf);
+    mlvpn_pktbuffer_reset(t->hpsbuf);
     update_process_title();
 }
 
@@ -1190,7 +2542,7 @@ mlvpn_rtun_send_auth(mlvpn_tunnel_t *t)
         {
             if (mlvpn_cb_is_full(t->hpsbuf)) {
                 log_warnx("net", "%s high priority buffer: overflow", t->name);
-                mlvpn_cb_reset(t->hpsbuf);
+                mlvpn_pktbuffer_reset(t->hpsbuf);
             }
             pkt = mlvpn_pktbuffer_write(t->hpsbuf);
             pkt->data[0] = 'O';
@@ -1245,41 +2597,132 @@ mlvpn_rtun_tick_connect(mlvpn_tunnel_t *t)
     }
 }
 
-void mlvpn_calc_bandwidth(uint32_t len)
+/* Sample the bytes counters of every tunnel, every MLVPN_RATE_INTERVAL.
+ * Rates are smoothed with an exponential moving average of time
+ * constant MLVPN_RATE_TAU. Tunnel weights are recomputed from them every
+ * MLVPN_WEIGHT_INTERVAL, off the data path.
+ */
+static void
+mlvpn_rate_update(EV_P_ ev_timer *w, int revents)
 {
-  ev_tstamp now=ev_now(EV_A);
-  if (lastsent==0) lastsent=now;
-  ev_tstamp diff=now - lastsent;
-  bandwidthdata+=len;
-  if (diff>3.0) {
-    lastsent=now;
-    bandwidth=((((double)bandwidthdata*8) / diff))/1000; // kbits/sec
-//    printf("%10.1f %lu %5.2f\n",bandwidth, bandwidthdata, diff);
-    bandwidthdata=0;
-
-    // what we can do here is add any bandwidth allocation
-    // The allocation should be per second.
-    // permittedis in bytes.
+    static ev_tstamp last_sample = 0, last_weight = 0;
+    ev_tstamp now = ev_now(EV_A);
+    ev_tstamp dt = now - last_sample;
+    double alpha, send_rate = 0, recv_rate = 0;
+    int loss = 0;
     mlvpn_tunnel_t *t;
+
+    if (last_sample == 0 || dt <= 0) {
+        last_sample = last_weight = now;
+        LIST_FOREACH(t, &rtuns, entries) {
+            t->rate_sentbytes = t->sentbytes;
+            t->rate_recvbytes = t->recvbytes;
+        }
+        return;
+    }
+    alpha = 1 - exp(-dt / MLVPN_RATE_TAU);
     LIST_FOREACH(t, &rtuns, entries) {
-      // permitted is in BYTES per second.
-      if (t->quota) {
-        t->permitted+=(((double)t->quota * diff)*1000.0)/8.0; // listed in kbps
-      }
+        t->send_rate += alpha *
+            ((t->sentbytes - t->rate_sentbytes) / dt - t->send_rate);
+        t->recv_rate += alpha *
+            ((t->recvbytes - t->rate_recvbytes) / dt - t->recv_rate);
+        t->rate_sentbytes = t->sentbytes;
+        t->rate_recvbytes = t->recvbytes;
+        mlvpn_cc_update(t);
+        mlvpn_rtun_pace_update(t);
+        send_rate += t->send_rate;
+        recv_rate += t->recv_rate;
+        if (t->wrr_slot >= 0)
+            loss = MAX(loss, mlvpn_loss_ratio(t));
+    }
+    last_sample = now;
+    mlvpn_fec_update(loss);
+    mlvpn_status.send_rate = send_rate;
+    mlvpn_status.recv_rate = recv_rate;
+    bandwidth = send_rate * 8 / 1000; // kbits/sec
+
+    if (now - last_weight >= MLVPN_WEIGHT_INTERVAL) {
+        last_weight = now;
+        mlvpn_rtun_recalc_weight();
     }
-    mlvpn_rtun_recalc_weight();
-  }
+}
+
+/* Token bucket of tunnels with a quota
+ * Tokens (t->permitted, in bytes) flow in at the quota rate, up to
+ * quota_burst, and are taken by every byte sent or received. The bucket
+ * is refilled from the event loop clock whenever it is looked at.
+ * Tokens preset above the burst (--permitted) are kept until spent.
+ */
+static double
+mlvpn_rtun_quota_rate(mlvpn_tunnel_t *t)
+{
+    return t->quota * 1000.0 / 8.0; /* quota is in kbit/s */
+}
+
+static int64_t
+mlvpn_rtun_quota_burst(mlvpn_tunnel_t *t)
+{
+    if (t->quota_burst)
+        return t->quota_burst;
+    return mlvpn_rtun_quota_rate(t) * MLVPN_QUOTA_BURST_MS / 1000.0;
+}
+
+int64_t
+mlvpn_rtun_tokens(mlvpn_tunnel_t *t)
+{
+    ev_tstamp now = ev_now(EV_A);
+    int64_t burst;
+    if (!t->quota)
+        return 0;
+    if (t->quota_refill > 0 && now > t->quota_refill) {
+        burst = mlvpn_rtun_quota_burst(t);
+        if (t->permitted < burst) {
+            t->permitted += mlvpn_rtun_quota_rate(t) * (now - t->quota_refill);
+            if (t->permitted > burst)
+                t->permitted = burst;
+        }
+    }
+    t->quota_refill = now;
+    return t->permitted;
+}
+
+/* Seconds until the bucket holds tokens again */
+double
+mlvpn_rtun_tokens_wait(mlvpn_tunnel_t *t)
+{
+    int64_t tokens = mlvpn_rtun_tokens(t);
+    if (!t->quota || tokens > 0)
+        return 0;
+    return (1 - tokens) / mlvpn_rtun_quota_rate(t);
 }
 
 mlvpn_tunnel_t *
 mlvpn_rtun_choose(uint32_t len)
 {
-  mlvpn_calc_bandwidth(len);
   mlvpn_tunnel_t *tun;
-  tun = mlvpn_rtun_wrr_choose(len);
+  if (mlvpn_options.scheduler == MLVPN_SCHED_EARLIEST)
+    tun = mlvpn_rtun_earliest_choose(len);
+  else
+    tun = mlvpn_rtun_wrr_choose();
   return tun;
 }
 
+/* Fastest tunnel in aggregation for a duplicated packet, other than
+ * except (the tunnel carrying the original) */
+mlvpn_tunnel_t *
+mlvpn_rtun_choose_duplicate(mlvpn_tunnel_t *except)
+{
+  mlvpn_tunnel_t *t, *best = NULL;
+  LIST_FOREACH(t, &rtuns, entries) {
+    if (t->wrr_slot < 0 || t == except || mlvpn_rtun_backlogged(t) ||
+        mlvpn_cb_is_full(t->hpsbuf) || t->peer_version < 2)
+      continue;
+    if (!best || t->srtt < best->srtt)
+      best = t;
+  }
+  return best;
+}
+
 static void
 mlvpn_rtun_send_keepalive(ev_tstamp now, mlvpn_tunnel_t *t)
 {
@@ -1294,6 +2737,62 @@ mlvpn_rtun_send_keepalive(ev_tstamp now, mlvpn_tunnel_t *t)
     t->next_keepalive = NEXT_KEEPALIVE(now, t);
 }
 
+/* Capacity probing
+ * A train of MLVPN_PROBE_TRAIN packets is queued back to back in the
+ * high priority buffer. The bottleneck of the link spaces them out: the
+ * peer divides the bytes received by the train dispersion and sends the
+ * rate back. Sizes grow along the train so that UDP GRO cannot coalesce
+ * the packets, which would hide their arrival times.
+ */
+static void
+mlvpn_rtun_send_probe(ev_tstamp now, mlvpn_tunnel_t *t)
+{
+    mlvpn_pkt_t *pkt;
+    mlvpn_probe_t *probe;
+    int i;
+
+    t->next_probe = now + t->probe_interval;
+    if (mlvpn_options.mtu < (int)sizeof(*probe) + MLVPN_PROBE_TRAIN ||
+            t->peer_version < 2)
+        return;
+    log_debug("protocol", "%s sending capacity probe", t->name);
+    t->probe_train++;
+    for (i = 0; i < MLVPN_PROBE_TRAIN; i++) {
+        if (mlvpn_cb_is_full(t->hpsbuf)) {
+            log_warnx("net", "%s high priority buffer: overflow", t->name);
+            return;
+        }
+        pkt = mlvpn_pkt_alloc();
+        pkt->type = MLVPN_PKT_PROBE;
+        pkt->len = mlvpn_options.mtu - (MLVPN_PROBE_TRAIN - 1 - i);
+        memset(pkt->data, 0, pkt->len);
+        probe = (mlvpn_probe_t *)pkt->data;
+        probe->train = htobe16(t->probe_train);
+        probe->idx = i;
+        probe->count = MLVPN_PROBE_TRAIN;
+        mlvpn_pktbuffer_push(t->hpsbuf, pkt);
+    }
+}
+
+/* Liveness probe: a keepalive the peer answers at once */
+static void
+mlvpn_rtun_send_liveness(mlvpn_tunnel_t *t)
+{
+    mlvpn_pkt_t *pkt;
+    if (mlvpn_cb_is_full(t->hpsbuf)) {
+        log_warnx("net", "%s high priority buffer: overflow", t->name);
+        return;
+    }
+    log_debug("protocol", "%s sending liveness probe", t->name);
+    pkt = mlvpn_pkt_alloc();
+    pkt->type = MLVPN_PKT_KEEPALIVE;
+    pkt->data[0] = MLVPN_KEEPALIVE_ECHO;
+    pkt->len = 1;
+    mlvpn_pktbuffer_push(t->hpsbuf, pkt);
+    if (!ev_is_active(&t->io_write))
+        ev_io_start(EV_A_ &t->io_write);
+}
+
 static void
 mlvpn_rtun_send_disconnect(mlvpn_tunnel_t *t)
 {
@@ -1313,12 +2812,16 @@ mlvpn_rtun_check_lossy(mlvpn_tunnel_t *tun)
 {
     int loss = mlvpn_loss_ratio(tun);
     int status_changed = 0;
-    if (loss >= tun->loss_tolerence && tun->status == MLVPN_AUTHOK) {
+    if (tun->liveness_lost && tun->status == MLVPN_AUTHOK) {
+        tun->status = MLVPN_LOSSY;
+        status_changed = 1;
+    } else if (loss >= tun->loss_tolerence && tun->status == MLVPN_AUTHOK) {
         log_info("rtt", "%s packet loss reached threashold: %d%%/%d%%",
             tun->name, loss, tun->loss_tolerence);
         tun->status = MLVPN_LOSSY;
         status_changed = 1;
-    } else if (loss < tun->loss_tolerence && tun->status == MLVPN_LOSSY) {
+    } else if (loss < tun->loss_tolerence && tun->status == MLVPN_LOSSY &&
+            !tun->liveness_lost) {
         log_info("rtt", "%s packet loss acceptable again: %d%%/%d%%",
             tun->name, loss, tun->loss_tolerence);
         tun->status = MLVPN_AUTHOK;
@@ -1327,20 +2830,26 @@ mlvpn_rtun_check_lossy(mlvpn_tunnel_t *tun)
     /* are all links in lossy mode ? switch to fallback ? */
     if (status_changed) {
         mlvpn_tunnel_t *t;
+        int all_lossy = 1;
         LIST_FOREACH(t, &rtuns, entries) {
             if (! t->fallback_only && t->status != MLVPN_LOSSY) {
-                mlvpn_status.fallback_mode = 0;
-                mlvpn_rtun_wrr_reset(&rtuns, mlvpn_status.fallback_mode);
-                return;
+                all_lossy = 0;
+                break;
             }
         }
-        if (mlvpn_options.fallback_available) {
+        if (! all_lossy) {
+            mlvpn_status.fallback_mode = 0;
+            mlvpn_rtun_wrr_reset(&rtuns, mlvpn_status.fallback_mode);
+        } else if (mlvpn_options.fallback_available) {
             log_info(NULL, "all tunnels are down or lossy, switch fallback mode");
             mlvpn_status.fallback_mode = 1;
             mlvpn_rtun_wrr_reset(&rtuns, mlvpn_status.fallback_mode);
         } else {
             log_info(NULL, "all tunnels are down or lossy but fallback is not available");
         }
+        /* out of the aggregation: its queue would wait behind the losses */
+        if (tun->status == MLVPN_LOSSY && tun->wrr_slot < 0)
+            mlvpn_rtun_requeue(tun);
     }
 }
 
@@ -1356,6 +2865,8 @@ mlvpn_rtun_check_timeout(EV_P_ ev_timer *w, int revents)
         } else {
             if (now > t->next_keepalive)
                 mlvpn_rtun_send_keepalive(now, t);
+            if (t->probe_interval && !t->bandwidth && now > t->next_probe)
+                mlvpn_rtun_send_probe(now, t);
         }
     } else if (t->status < MLVPN_AUTHOK) {
         mlvpn_rtun_tick_connect(t);
@@ -1366,12 +2877,69 @@ mlvpn_rtun_check_timeout(EV_P_ ev_timer *w, int revents)
     mlvpn_rtun_check_lossy(t);
 }
 
+/* Liveness detection
+ * Every liveness_interval, a tunnel which received nothing during the
+ * interval sends a probe the peer answers at once. Any packet received,
+ * data included, proves the link is alive, so probes are only sent while
+ * it is idle. After liveness_misses silent intervals (plus the round trip
+ * time) the link is removed from aggregation as lossy, until a packet
+ * comes back. The tunnel still goes down after its timeout.
+ */
+static void
+mlvpn_rtun_check_liveness(EV_P_ ev_timer *w, int revents)
+{
+    mlvpn_tunnel_t *t = w->data;
+    ev_tstamp now = ev_now(EV_A);
+    double silent = (now - t->last_activity) * 1000.0;
+    double limit = (double)t->liveness_interval * t->liveness_misses;
+
+    if (t->status < MLVPN_AUTHOK)
+        return;
+    if (t->rtt_hit)
+        limit += t->srtt;
+    if (!t->liveness_lost && silent >= limit) {
+        log_info("protocol", "%s nothing received for %.0fms",
+            t->name, silent);
+        t->liveness_lost = 1;
+        mlvpn_rtun_check_lossy(t);
+    }
+    if (silent >= t->liveness_interval)
+        mlvpn_rtun_send_liveness(t);
+}
+
+/* (Re)arm the liveness timer after a change of its settings */
+void
+mlvpn_rtun_set_liveness(mlvpn_tunnel_t *t)
+{
+    double interval = t->liveness_interval / 1000.0;
+    ev_timer_stop(EV_A_ &t->io_liveness);
+    if (t->liveness_interval && t->status >= MLVPN_AUTHOK) {
+        ev_timer_set(&t->io_liveness, interval, interval);
+        ev_timer_start(EV_A_ &t->io_liveness);
+    } else if (t->liveness_lost) {
+        t->liveness_lost = 0;
+        mlvpn_rtun_check_lossy(t);
+    }
+}
+
+/*
+ * Reorder controller, run every second.
+ * The hold time covers the one way delay spread between the fastest and
+ * the slowest link, plus their jitter: a packet sent on the slow link
+ * is expected within that time after the next one on the fast link.
+ * The depth is the number of packets received during the hold time.
+ */
 static void
 mlvpn_rtun_adjust_reorder_timeout(EV_P_ ev_timer *w, int revents)
 {
     mlvpn_tunnel_t *t;
-    double max_srtt = 0.0;
-    double tmp;
+    mlvpn_tunnel_t *ref = NULL;
+    double max_srtt = 0.0, min_srtt = -1;
+    double min_owd = 0.0, max_owd = 0.0, max_owdvar = 0.0;
+    double tmp, hold, rate;
+    uint32_t depth;
+    static ev_tstamp last_adjust = 0;
+    ev_tstamp now = ev_now(EV_A);
 
     LIST_FOREACH(t, &rtuns, entries)
     {
@@ -1382,27 +2950,130 @@ mlvpn_rtun_adjust_reorder_timeout(EV_P_ ev_timer *w, int revents)
             if (!t->fallback_only && t->rtt_hit) {
                 tmp = t->srtt + (4 * t->rttvar);
                 max_srtt = max_srtt > tmp ? max_srtt : tmp;
+                if (min_srtt < 0 || t->srtt < min_srtt)
+                    min_srtt = t->srtt;
+            }
+            if (!t->fallback_only && t->owd_hit) {
+                if (! ref)
+                    ref = t;
+                tmp = mlvpn_ts16_wrap(t->owd - ref->owd);
+                min_owd = MIN(min_owd, tmp);
+                max_owd = MAX(max_owd, tmp);
+                max_owdvar = MAX(max_owdvar, t->owdvar);
             }
         }
     }
+    LIST_FOREACH(t, &rtuns, entries)
+    {
+        if (ref && t->owd_hit)
+            t->owd_rel = mlvpn_ts16_wrap(t->owd - ref->owd) - min_owd;
+        else
+            t->owd_rel = 0;
+    }
 
     /* Update the reorder algorithm */
-    if (max_srtt > 0) {
-        /* Apply a factor to the srtt in order to get a window */
-        max_srtt *= 2.2;
-        log_debug("reorder", "adjusting reordering drain timeout to %.0fms",
-            max_srtt);
-        reorder_drain_timeout.repeat = max_srtt / 1000.0;
+    if (ref) {
+        mlvpn_status.reorder_spread = max_owd - min_owd;
+        hold = mlvpn_status.reorder_spread + (4 * max_owdvar);
+    } else if (max_srtt > 0) {
+        /* No one way delay yet: apply a factor to the srtt */
+        mlvpn_status.reorder_spread = 0;
+        hold = max_srtt * 2.2;
+    } else {
+        mlvpn_status.reorder_spread = 0;
+        hold = MLVPN_REORDER_HOLD_MAX; /* Conservative 800ms shot */
+    }
+    hold = MAX(MLVPN_REORDER_HOLD_MIN, MIN(hold, MLVPN_REORDER_HOLD_MAX));
+
+    /* Selective retransmission: a hole open longer than the delay spread
+     * plus half the jitter allowance is requested. The retransmit takes
+     * a round trip on the fastest link (plus a margin for queueing): hold
+     * the hole that long if it fits the budget. */
+    if (mlvpn_options.retransmit_budget && reorder_buffer && min_srtt >= 0) {
+        if (ref)
+            mlvpn_status.nack_wait = mlvpn_status.reorder_spread +
+                (2 * max_owdvar);
+        else
+            mlvpn_status.nack_wait = hold / 2;
+        tmp = mlvpn_status.nack_wait + (min_srtt * 1.25);
+        if (tmp <= mlvpn_options.retransmit_budget)
+            hold = MAX(hold, tmp);
+        mlvpn_status.nack_deadline = hold - (min_srtt * 1.25);
+    } else {
+        mlvpn_status.nack_wait = 0;
+        mlvpn_status.nack_deadline = 0;
+    }
+    reorder_drain_timeout.repeat = hold / 1000.0;
+    mlvpn_status.reorder_hold = hold;
+
+    if (last_adjust > 0 && now > last_adjust) {
+        rate = reorder_pkts / (now - last_adjust);
+        mlvpn_status.reorder_rate = (mlvpn_status.reorder_rate * 3 + rate) / 4;
+    }
+    reorder_pkts = 0;
+    last_adjust = now;
+
+    if (reorder_buffer) {
+        depth = MLVPN_REORDER_DEPTH;
+        if (mlvpn_status.reorder_rate > 0)
+            depth = MAX(4,
+                (uint32_t)(mlvpn_status.reorder_rate * hold / 1000.0) + 1);
+        depth = MIN(depth, MIN(mlvpn_reorder_size(reorder_buffer),
+            freebuf->size));
+        mlvpn_reorder_set_depth(reorder_buffer, depth);
+        mlvpn_status.reorder_depth = depth;
     } else {
-        reorder_drain_timeout.repeat = 0.8; /* Conservative 800ms shot */
+        mlvpn_status.reorder_depth = 0;
     }
+    log_debug("reorder", "delay spread %.0fms, drain timeout %.0fms, "
+        "depth %u packets (%.0f pkts/s)", mlvpn_status.reorder_spread,
+        hold, mlvpn_status.reorder_depth, mlvpn_status.reorder_rate);
+}
+
+/* Backpressure
+ * When every tunnel is backlogged, stop reading the tunnel interface:
+ * packets wait in the kernel queue of the interface, and local senders
+ * are slowed down instead of losing packets in mlvpn. Reading resumes
+ * as soon as a tunnel goes below MLVPN_SBUF_LOWWATER, or goes down.
+ */
+void
+mlvpn_tuntap_pause()
+{
+    int i;
+    if (tuntap.paused)
+        return;
+    log_debug("tuntap", "%s every tunnel is backlogged, stop reading",
+        tuntap.devname);
+    tuntap.paused = 1;
+    ev_io_stop(EV_A_ &tuntap.io_read);
+    for (i = 0; i < tuntap.queues - 1; i++)
+        ev_io_stop(EV_A_ &tuntap.mq_read[i]);
+}
+
+static void
+mlvpn_tuntap_resume()
+{
+    int i;
+    if (! tuntap.paused)
+        return;
+    log_debug("tuntap", "%s resume reading", tuntap.devname);
+    tuntap.paused = 0;
+    ev_io_start(EV_A_ &tuntap.io_read);
+    for (i = 0; i < tuntap.queues - 1; i++)
+        ev_io_start(EV_A_ &tuntap.mq_read[i]);
 }
 
 static void
 tuntap_io_event(EV_P_ ev_io *w, int revents)
 {
+    int i;
     if (revents & EV_READ) {
-        mlvpn_tuntap_read(&tuntap);
+        /* drain the queue until it would block, the budget is spent
+         * or the tunnels are backlogged */
+        for (i = 0; i < tuntap.read_budget && ! tuntap.paused; i++) {
+            if (mlvpn_tuntap_read(&tuntap, w->fd) <= 0)
+                break;
+        }
     } else if (revents & EV_WRITE) {
         mlvpn_tuntap_write(&tuntap);
         /* Nothing else to read */
@@ -1416,14 +3087,21 @@ static void
 mlvpn_tuntap_init()
 {
     mlvpn_proto_t proto;
+    int i;
     memset(&tuntap, 0, sizeof(tuntap));
     snprintf(tuntap.devname, MLVPN_IFNAMSIZ-1, "%s", "mlvpn0");
     tuntap.maxmtu = 1500 - PKTHDRSIZ(proto) - IP4_UDP_OVERHEAD;
     log_debug(NULL, "absolute maximum mtu: %d", tuntap.maxmtu);
     tuntap.type = MLVPN_TUNTAPMODE_TUN;
+    tuntap.queues = 1;
+    tuntap.read_budget = MLVPN_TUNTAP_READ_BUDGET;
     tuntap.sbuf = mlvpn_pktbuffer_init(PKTBUFSIZE);
     ev_init(&tuntap.io_read, tuntap_io_event);
     ev_init(&tuntap.io_write, tuntap_io_event);
+    for (i = 0; i < MLVPN_TUNTAP_MAXQUEUES - 1; i++) {
+        tuntap.mq_fd[i] = -1;
+        ev_init(&tuntap.mq_read[i], tuntap_io_event);
+    }
 }
 
 static void
@@ -1645,7 +3323,8 @@ main(int argc, char **argv)
         update_process_title();
 
     LIST_INIT(&rtuns);
-    freebuf = mlvpn_freebuffer_init(512);
+    /* receive batch, tuntap read and packets in flight */
+    mlvpn_pkt_pool_reserve(2 * MLVPN_BATCH_MAX);
 
     /* Kill me if my root process dies ! */
 #ifdef HAVE_LINUX
@@ -1673,14 +3352,26 @@ main(int argc, char **argv)
      * SRTT values will be available
      */
     ev_init(&reorder_drain_timeout, &mlvpn_rtun_reorder_drain_timeout);
+    ev_timer_init(&nack_timeout, &mlvpn_rtun_nack_timeout,
+        MLVPN_NACK_INTERVAL, MLVPN_NACK_INTERVAL);
     ev_io_set(&tuntap.io_read, tuntap.fd, EV_READ);
     ev_io_set(&tuntap.io_write, tuntap.fd, EV_WRITE);
     ev_io_start(loop, &tuntap.io_read);
+    for (i = 0; i < tuntap.queues - 1; i++) {
+        mlvpn_sock_set_nonblocking(tuntap.mq_fd[i]);
+        ev_io_set(&tuntap.mq_read[i], tuntap.mq_fd[i], EV_READ);
+        ev_io_start(loop, &tuntap.mq_read[i]);
+    }
+    if (tuntap.queues > 1)
+        log_info(NULL, "%s using %d queues", tuntap.devname, tuntap.queues);
 
     ev_timer_init(&reorder_adjust_rtt_timeout,
         mlvpn_rtun_adjust_reorder_timeout, 0., 1.0);
     ev_timer_start(EV_A_ &reorder_adjust_rtt_timeout);
 
+    ev_timer_init(&rate_timeout, mlvpn_rate_update, 0., MLVPN_RATE_INTERVAL);
+    ev_timer_start(EV_A_ &rate_timeout);
+
     priv_set_running_state();
 
 #ifdef ENABLE_CONTROL
@@ -52,6 +52,54 @@
 /* Number of packets in the queue. Each pkt is ~ 1520 */
 /* 1520 * 128 ~= 24 KBytes of data maximum per channel VMSize */
 #define PKTBUFSIZE 1024
+/* A tunnel holding more packets than the high water mark in its send
+ * buffer is skipped by the scheduler. When all are, the tunnel interface
+ * is not read until one falls below the low water mark. */
+#define MLVPN_SBUF_HIGHWATER (PKTBUFSIZE * 3 / 4)
+#define MLVPN_SBUF_LOWWATER (PKTBUFSIZE / 2)
+
+/* Maximum number of datagrams moved per recvmmsg/sendmmsg call */
+#define MLVPN_BATCH_MAX 64
+
+/* UDP GSO/GRO limits (Linux) */
+#define MLVPN_GSO_MAXSEGS 64
+#define MLVPN_GSO_MAXBYTES 65000
+#define MLVPN_GRO_BATCH 8
+#define MLVPN_GRO_BUFSIZ 65536
+
+/* Throughput estimation: sampling period and EWMA time constant (s) */
+#define MLVPN_RATE_INTERVAL 0.1
+#define MLVPN_RATE_TAU 1.0
+/* How often tunnel weights are recomputed (s) */
+#define MLVPN_WEIGHT_INTERVAL 1.0
+
+/* Capacity probes: packets per train, default seconds between trains */
+#define MLVPN_PROBE_TRAIN 8
+#define MLVPN_PROBE_INTERVAL 10
+/* Shortest train dispersion we can time reliably (s) */
+#define MLVPN_PROBE_MIN_DISPERSION 0.0002
+
+/* Delay based congestion control: default target queueing delay (ms),
+ * base delay history kept as MLVPN_CC_HISTORY minima of
+ * MLVPN_CC_BASE_PERIOD seconds, rate gain (per second), minimum rate
+ * (bytes/s) */
+#define MLVPN_CC_TARGET 100
+#define MLVPN_CC_HISTORY 10
+#define MLVPN_CC_BASE_PERIOD 60.0
+#define MLVPN_CC_GAIN 1.0
+#define MLVPN_CC_MIN_RATE 16384.0
+
+/* Pacing: rate above the link capacity (the congestion control limit
+ * is followed as is), and burst allowed at once (s) */
+#define MLVPN_PACE_GAIN 1.25
+#define MLVPN_PACE_QUANTUM 0.002
+
+/* Default token bucket depth, in ms of quota */
+#define MLVPN_QUOTA_BURST_MS 100
+
+/* Bounds of the reorder drain timeout (ms) */
+#define MLVPN_REORDER_HOLD_MIN 10.0
+#define MLVPN_REORDER_HOLD_MAX 800.0
 
 /* tuntap interface name size */
 #ifndef IFNAMSIZ
@@ -77,11 +125,36 @@
 #define MLVPN_IO_TIMEOUT_INCREMENT 2
 
 #define NEXT_KEEPALIVE(now, t) (now + 2)
+/* How often the receiver looks for holes to request (s) */
+#define MLVPN_NACK_INTERVAL 0.005
+/* Bounds of the number of data packets per parity packet */
+#define MLVPN_FEC_GROUP_MIN 2
+#define MLVPN_FEC_GROUP_MAX 64
+/* Silent liveness intervals before a link is considered lossy */
+#define MLVPN_LIVENESS_MISSES 3
+/* Bundles are sent without waiting once a packet of this size can't be
+ * added anymore */
+#define MLVPN_BUNDLE_SMALL 200
+/* Longest bundle_delay (ms) */
+#define MLVPN_BUNDLE_DELAY_MAX 100
 /* Protocol version of mlvpn
  * version 0: mlvpn 2.0 to 2.1 
  * version 1: mlvpn 2.2+ (add reorder field in mlvpn_proto_t)
+ * version 2: compact header (mlvpn_proto2_t). AUTH and AUTH_OK keep the
+ *            full header, with the version of the sender. Other packets
+ *            use the compact header if the peer announced version 2 or
+ *            more, the full header as version 1 otherwise.
+ *            BUNDLE, FEC, NACK, DUPLICATE, RETRANSMIT and PROBE packets
+ *            are only sent to version 2 peers: version 1 peers get plain
+ *            DATA packets, and no probes.
  */
-#define MLVPN_PROTOCOL_VERSION 1
+#define MLVPN_PROTOCOL_VERSION 2
+
+/* How a tunnel is chosen for each packet */
+enum mlvpn_scheduler {
+    MLVPN_SCHED_WRR,      /* weighted round robin */
+    MLVPN_SCHED_EARLIEST  /* earliest predicted arrival */
+};
 
 struct mlvpn_options_s
 {
@@ -112,6 +185,10 @@ struct mlvpn_options_s
     int root_allowed;
     uint32_t reorder_buffer_size;
     uint32_t fallback_available;
+    enum mlvpn_scheduler scheduler;
+    uint32_t fec; /* data packets per parity packet at most, 0: off */
+    uint32_t retransmit_budget; /* ms added to wait for a retransmit */
+    uint32_t duplicate_dscp; /* DSCP of the packets to duplicate, 0: off */
 };
 
 struct mlvpn_status_s
@@ -121,6 +198,29 @@ struct mlvpn_status_s
     int initialized;
     time_t start_time;
     time_t last_reload;
+    /* reorder controller decisions */
+    uint32_t reorder_depth;     /* packets held before skipping a hole */
+    double reorder_hold;        /* drain timeout (ms) */
+    double reorder_spread;      /* one way delay spread between links (ms) */
+    double reorder_rate;        /* packets/s going through the buffer */
+    /* aggregate throughput of the tunnels (bytes/s) */
+    double send_rate;
+    double recv_rate;
+    /* forward error correction */
+    uint32_t fec_group;         /* data packets per parity packet */
+    uint64_t fec_rebuilt;       /* lost packets rebuilt from parity */
+    uint64_t fec_duplicates;    /* rebuilt packets which came in anyway */
+    /* selective retransmission */
+    double nack_wait;           /* age of a hole requested (ms) */
+    double nack_deadline;       /* age after which it is too late (ms) */
+    uint64_t nack_sent;         /* packets requested */
+    uint64_t nack_received;     /* retransmits received */
+    uint64_t nack_retransmitted; /* packets sent again */
+    /* packet duplication */
+    uint64_t dup_sent;          /* copies sent */
+    uint64_t dup_bytes;         /* bytes of copies sent */
+    uint64_t dup_received;      /* copies received */
+    uint64_t dup_useful;        /* copies which came in first */
 };
 
 enum chap_status {
@@ -132,6 +232,28 @@ enum chap_status {
 
 LIST_HEAD(rtunhead, mlvpn_tunnel_s) rtuns;
 
+/* Minimum of a delay over the last minutes, and since the last run of
+ * the congestion controller */
+struct mlvpn_cc_base
+{
+    double min[MLVPN_CC_HISTORY];
+    int idx;
+    int len;
+    ev_tstamp rotated;
+    double cur;
+    int cur_hit;
+};
+
+/* Packets encapsulated in place, waiting to be sent with sendmmsg */
+struct mlvpn_txbatch
+{
+    int count;            /* datagrams in the batch */
+    int sent;             /* datagrams already accepted by the kernel */
+    size_t len[MLVPN_BATCH_MAX];
+    mlvpn_proto_t *wire[MLVPN_BATCH_MAX]; /* datagram inside pkts[i] */
+    mlvpn_pkt_t *pkts[MLVPN_BATCH_MAX];
+};
+
 typedef struct mlvpn_tunnel_s
 {
     LIST_ENTRY(mlvpn_tunnel_s) entries;
@@ -156,16 +278,64 @@ typedef struct mlvpn_tunnel_s
     int rtt_hit;
     double srtt;
     double rttvar;
+    int owd_hit;
+    double owd;           /* one way delay from the peer + clock offset (ms) */
+    double owdvar;        /* one way delay variation (ms) */
+    double owd_rel;       /* one way delay above the fastest link (ms) */
+    struct mlvpn_cc_base rtt_base;
+    struct mlvpn_cc_base owd_base;
+    uint32_t cc_target;   /* target queueing delay (ms), 0: disabled */
+    double cc_qdelay;     /* queueing delay on the way to the peer (ms) */
+    double cc_rate;       /* allowed bytes/s, 0 when not congested */
+    ev_tstamp cc_updated; /* last rate adjustment */
     double weight;        /* For weight round robin */
+    int wrr_slot;         /* scheduler entry, -1 when not scheduled */
     uint32_t flow_id;
+    uint8_t peer_version;  /* protocol version in the peer AUTH */
+    uint32_t peer_flow_id; /* flow_id of the peer, for compact headers */
+    uint64_t peer_seq;     /* highest seq received from the peer */
     uint64_t sentpackets; /* 64bit packets sent counter */
     uint64_t recvpackets; /* 64bit packets recv counter */
     uint64_t sentbytes;   /* 64bit bytes sent counter */
     uint64_t recvbytes;   /* 64bit bytes recv counter */
-    int64_t permitted;  /* how many bytes we can send */
-    uint32_t quota; /* how many bytes per second we can send */
+    double send_rate;     /* bytes/s sent, smoothed */
+    double recv_rate;     /* bytes/s received, smoothed */
+    uint64_t rate_sentbytes; /* sentbytes at the last rate sample */
+    uint64_t rate_recvbytes; /* recvbytes at the last rate sample */
+    int64_t permitted;  /* how many bytes we can send (token bucket) */
+    uint32_t quota; /* how many kbits per second we can send */
+    uint32_t quota_burst; /* token bucket depth in bytes */
+    ev_tstamp quota_refill; /* last token bucket refill */
     uint32_t timeout;     /* configured timeout in seconds */
     uint32_t bandwidth;   /* bandwidth in bytes per second */
+    uint32_t bandwidth_probe; /* measured bandwidth in bytes per second */
+    uint32_t probe_interval; /* seconds between capacity probes, 0: off */
+    uint32_t liveness_interval; /* ms between liveness probes, 0: off */
+    uint32_t liveness_misses; /* silent intervals before the link is lossy */
+    int liveness_lost;    /* lossy since nothing was received */
+    uint64_t fec_base;    /* parity group this tunnel last carried */
+    uint32_t fec_members; /* packets of that group sent on this tunnel */
+    ev_tstamp next_probe;
+    uint16_t probe_train;  /* last train sent */
+    uint16_t probe_rx_train; /* train being received */
+    uint32_t probe_rx_count;
+    uint32_t probe_rx_bytes; /* bytes received after the first packet */
+    ev_tstamp probe_rx_first;
+    ev_tstamp probe_rx_last;
+    int pacing;           /* space the data packets at the tunnel rate */
+    double pace_rate;     /* pacing rate (bytes/s), 0: not paced */
+    ev_tstamp pace_next;  /* when the next data packet may leave */
+    uint64_t pace_deferred; /* sends delayed by the pacing */
+    int bundle;           /* pack queued data packets into one datagram */
+    uint32_t bundle_delay; /* ms a data packet may wait for a bundle */
+    int bundle_expired;   /* the bundle waited bundle_delay already */
+    uint64_t bundled;     /* data packets sent in bundles */
+    uint32_t recv_batch;  /* datagrams read per wakeup (recvmmsg) */
+    uint32_t send_batch;  /* datagrams sent per wakeup (sendmmsg) */
+    struct mlvpn_txbatch *txbatch;
+    int udp_offload;      /* use UDP GSO/GRO when the kernel supports it */
+    int udp_gso;          /* UDP_SEGMENT accepted on this socket */
+    int udp_gro;          /* UDP_GRO enabled on this socket */
     circular_buffer_t *sbuf;    /* send buffer */
     circular_buffer_t *hpsbuf;  /* high priority buffer */
     struct addrinfo *addrinfo;
@@ -178,6 +348,9 @@ typedef struct mlvpn_tunnel_s
     ev_io io_read;
     ev_io io_write;
     ev_timer io_timeout;
+    ev_timer io_pace;
+    ev_timer io_liveness;
+    ev_timer io_bundle;
 } mlvpn_tunnel_t;
 
 #ifdef HAVE_FILTERS
@@ -194,8 +367,19 @@ int mlvpn_sock_set_nonblocking(int fd);
 int mlvpn_loss_ratio(mlvpn_tunnel_t *tun);
 int mlvpn_rtun_wrr_reset(struct rtunhead *head, int use_fallbacks);
 void mlvpn_rtun_set_weight(mlvpn_tunnel_t *t, double weight);
+void mlvpn_rtun_wrr_unblock(mlvpn_tunnel_t *t);
+void mlvpn_rtun_wrr_drained(mlvpn_tunnel_t *t);
+uint32_t mlvpn_rtun_bandwidth(mlvpn_tunnel_t *t);
+void mlvpn_rtun_reorder_resize(uint32_t size);
+int mlvpn_rtun_backlogged(mlvpn_tunnel_t *t);
+int mlvpn_rtun_all_backlogged();
+void mlvpn_tuntap_pause();
+int64_t mlvpn_rtun_tokens(mlvpn_tunnel_t *t);
+double mlvpn_rtun_tokens_wait(mlvpn_tunnel_t *t);
 mlvpn_tunnel_t *mlvpn_rtun_wrr_choose();
+mlvpn_tunnel_t *mlvpn_rtun_earliest_choose(uint32_t len);
 mlvpn_tunnel_t *mlvpn_rtun_choose(uint32_t len);
+mlvpn_tunnel_t *mlvpn_rtun_choose_duplicate(mlvpn_tunnel_t *except);
 mlvpn_tunnel_t *mlvpn_rtun_new(const char *name,
     const char *bindaddr, const char *bindport, uint32_t bindfib,
     const char *destaddr, const char *destport,
@@ -204,9 +388,29 @@ mlvpn_tunnel_t *mlvpn_rtun_new(const char *name,
     uint32_t loss_tolerence, uint32_t quota);
 void mlvpn_rtun_drop(mlvpn_tunnel_t *t);
 void mlvpn_rtun_status_down(mlvpn_tunnel_t *t);
+void mlvpn_rtun_set_offload(mlvpn_tunnel_t *t);
+void mlvpn_rtun_set_liveness(mlvpn_tunnel_t *t);
+void mlvpn_fec_update(int loss);
+mlvpn_pkt_t *mlvpn_fec_tx_add(mlvpn_tunnel_t *tun, mlvpn_pkt_t *pkt,
+    uint64_t seq);
+int mlvpn_fec_rx_data(mlvpn_pkt_t *pkt, mlvpn_pkt_t **rebuilt);
+mlvpn_pkt_t *mlvpn_fec_rx_parity(mlvpn_pkt_t *pkt);
+void mlvpn_fec_reset();
+void mlvpn_nack_init();
+void mlvpn_nack_cache(mlvpn_pkt_t *pkt, uint64_t seq);
+int mlvpn_nack_recv(mlvpn_pkt_t *nack, mlvpn_pkt_t **rtx, int max);
+int mlvpn_nack_rx_data(mlvpn_pkt_t *pkt, int rtx);
+int mlvpn_nack_pending();
+mlvpn_pkt_t *mlvpn_nack_build(ev_tstamp now);
+void mlvpn_nack_reset();
+int mlvpn_dup_match(mlvpn_pkt_t *pkt);
+mlvpn_pkt_t *mlvpn_dup_copy(mlvpn_pkt_t *pkt, uint64_t seq);
+int mlvpn_dup_rx_data(mlvpn_pkt_t *pkt, int dup);
+void mlvpn_dup_reset();
 #ifdef HAVE_FILTERS
 int mlvpn_filters_add(const struct bpf_program *filter, mlvpn_tunnel_t *tun);
 mlvpn_tunnel_t *mlvpn_filters_choose(uint32_t pktlen, const u_char *pktdata);
+int mlvpn_filters_duplicate(uint32_t pktlen, const u_char *pktdata);
 #endif
 
 #include "privsep.h"
@@ -0,0 +1,244 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "mlvpn.h"
+
+extern struct mlvpn_options_s mlvpn_options;
+extern struct mlvpn_status_s mlvpn_status;
+
+/* Selective retransmission
+ * The receiver watches the data_seq holes: a hole still open after the
+ * one way delay spread between the links (nack_wait) is probably a loss.
+ * Its sequence number is requested in a NACK packet, if a retransmit on
+ * the fastest link can still arrive before the reorder buffer gives up on
+ * it (nack_deadline). The sender keeps a copy of the last data packets
+ * sent, and sends the packets requested again on its fastest link. The
+ * reorder controller computes both delays, and lengthens the reorder
+ * hold time to cover a retransmit within retransmit_budget.
+ * Holes are remembered a little longer, to drop the original of a packet
+ * retransmitted when it comes in anyway.
+ */
+
+/* Data packets kept by the sender */
+#define NACK_CACHE 1024
+/* Holes followed by the receiver */
+#define NACK_HOLES 128
+/* Larger holes are not followed (burst loss, or the peer restarted) */
+#define NACK_MAX_GAP 32
+/* How long a hole is remembered (s) */
+#define NACK_HOLE_TTL 1.0
+
+struct nack_slot {
+    uint64_t seq;
+    uint16_t len;
+    uint8_t used;
+    char data[DEFAULT_MTU];
+};
+
+enum {
+    NACK_EMPTY,
+    NACK_MISSING,
+    NACK_REQUESTED,
+    NACK_FILLED
+};
+
+struct nack_hole {
+    uint64_t seq;
+    ev_tstamp at;   /* when the hole appeared */
+    uint8_t state;
+};
+
+/* allocated when retransmit_budget is set, or on the first NACK */
+static struct nack_slot *nack_cache = NULL;
+
+static struct {
+    int started;
+    uint64_t highest;
+    uint32_t missing;   /* holes not requested yet */
+    struct nack_hole hole[NACK_HOLES];
+} nack_rx;
+
+void
+mlvpn_nack_init()
+{
+    if (nack_cache)
+        return;
+    nack_cache = calloc(NACK_CACHE, sizeof(*nack_cache));
+    if (!nack_cache)
+        fatal("nack", "calloc failed");
+}
+
+/* Keep a copy of a data packet sent, before its encryption */
+void
+mlvpn_nack_cache(mlvpn_pkt_t *pkt, uint64_t seq)
+{
+    struct nack_slot *s;
+    if (!nack_cache)
+        return;
+    s = &nack_cache[seq % NACK_CACHE];
+    s->seq = seq;
+    s->len = pkt->len;
+    s->used = 1;
+    memcpy(s->data, pkt->data, pkt->len);
+}
+
+/* A NACK packet was received: fill rtx with the packets to send again.
+ * Returns the number of packets. */
+int
+mlvpn_nack_recv(mlvpn_pkt_t *nack, mlvpn_pkt_t **rtx, int max)
+{
+    uint64_t seq;
+    struct nack_slot *s;
+    mlvpn_pkt_t *pkt;
+    int i, n = 0;
+
+    mlvpn_nack_init();
+    for (i = 0; i < nack->len / 8 && n < max; i++) {
+        memcpy(&seq, nack->data + i * 8, sizeof(seq));
+        seq = be64toh(seq);
+        s = &nack_cache[seq % NACK_CACHE];
+        if (!s->used || s->seq != seq) {
+            log_debug("nack", "packet %"PRIu64" not in cache", seq);
+            continue;
+        }
+        pkt = mlvpn_pkt_alloc();
+        pkt->type = MLVPN_PKT_RETRANSMIT;
+        pkt->seq = seq;
+        pkt->len = s->len;
+        memcpy(pkt->data, s->data, s->len);
+        rtx[n++] = pkt;
+    }
+    mlvpn_status.nack_retransmitted += n;
+    return n;
+}
+
+void
+mlvpn_nack_reset()
+{
+    memset(&nack_rx, 0, sizeof(nack_rx));
+}
+
+static void
+mlvpn_nack_add_hole(uint64_t seq, ev_tstamp now)
+{
+    struct nack_hole *h, *slot = NULL;
+    int i;
+    for (i = 0; i < NACK_HOLES; i++) {
+        h = &nack_rx.hole[i];
+        if (h->state == NACK_EMPTY || !slot || h->at < slot->at)
+            slot = h;
+        if (h->state == NACK_EMPTY)
+            break;
+    }
+    if (slot->state == NACK_MISSING)
+        nack_rx.missing--;
+    slot->seq = seq;
+    slot->at = now;
+    slot->state = NACK_MISSING;
+    nack_rx.missing++;
+}
+
+/* A data packet was received (rtx: sent again after a NACK). Returns -1
+ * if it is the duplicate of a packet retransmitted, 0 otherwise.
+ */
+int
+mlvpn_nack_rx_data(mlvpn_pkt_t *pkt, int rtx)
+{
+    struct nack_hole *h;
+    uint64_t seq;
+    int i;
+
+    if (rtx)
+        mlvpn_status.nack_received++;
+    if (!mlvpn_options.retransmit_budget)
+        return 0;
+    if (!nack_rx.started) {
+        nack_rx.started = 1;
+        nack_rx.highest = pkt->seq;
+        return 0;
+    }
+    if (pkt->seq + NACK_CACHE < nack_rx.highest) {
+        /* too old to have been requested (the state is reset when the
+         * peer restarts, see mlvpn_protocol_read) */
+        return 0;
+    }
+    if (pkt->seq > nack_rx.highest) {
+        if (pkt->seq - nack_rx.highest - 1 <= NACK_MAX_GAP) {
+            ev_tstamp now = ev_now(EV_DEFAULT_UC);
+            for (seq = nack_rx.highest + 1; seq < pkt->seq; seq++)
+                mlvpn_nack_add_hole(seq, now);
+        }
+        nack_rx.highest = pkt->seq;
+        return 0;
+    }
+    for (i = 0; i < NACK_HOLES; i++) {
+        h = &nack_rx.hole[i];
+        if (h->state == NACK_EMPTY || h->seq != pkt->seq)
+            continue;
+        if (h->state == NACK_FILLED)
+            return -1;
+        if (h->state == NACK_MISSING)
+            nack_rx.missing--;
+        h->state = NACK_FILLED;
+        break;
+    }
+    return 0;
+}
+
+/* Holes are being followed */
+int
+mlvpn_nack_pending()
+{
+    int i;
+    if (nack_rx.missing)
+        return 1;
+    for (i = 0; i < NACK_HOLES; i++)
+        if (nack_rx.hole[i].state != NACK_EMPTY)
+            return 1;
+    return 0;
+}
+
+/* Build the NACK packet of the holes due, or return NULL */
+mlvpn_pkt_t *
+mlvpn_nack_build(ev_tstamp now)
+{
+    mlvpn_pkt_t *pkt = NULL;
+    struct nack_hole *h;
+    double age;
+    uint64_t seq;
+    int i;
+
+    for (i = 0; i < NACK_HOLES; i++) {
+        h = &nack_rx.hole[i];
+        if (h->state == NACK_EMPTY)
+            continue;
+        age = (now - h->at) * 1000.0;
+        if (age > NACK_HOLE_TTL * 1000.0) {
+            if (h->state == NACK_MISSING)
+                nack_rx.missing--;
+            h->state = NACK_EMPTY;
+            continue;
+        }
+        if (h->state != NACK_MISSING || age < mlvpn_status.nack_wait)
+            continue;
+        if (age > mlvpn_status.nack_deadline) {
+            /* a retransmit would arrive too late: stop following it */
+            nack_rx.missing--;
+            h->state = NACK_EMPTY;
+            continue;
+        }
+        if (!pkt) {
+            pkt = mlvpn_pkt_alloc();
+            pkt->type = MLVPN_PKT_NACK;
+        }
+        if (pkt->len + sizeof(seq) > (size_t)mlvpn_options.mtu)
+            break;
+        nack_rx.missing--;
+        h->state = NACK_REQUESTED;
+        seq = htobe64(h->seq);
+        memcpy(pkt->data + pkt->len, &seq, sizeof(seq));
+        pkt->len += sizeof(seq);
+        mlvpn_status.nack_sent++;
+    }
+    return pkt;
+}
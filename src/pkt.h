@@ -11,18 +11,16 @@ enum {
     MLVPN_PKT_AUTH_OK,
     MLVPN_PKT_KEEPALIVE,
     MLVPN_PKT_DATA,
-    MLVPN_PKT_DISCONNECT
+    MLVPN_PKT_DISCONNECT,
+    MLVPN_PKT_PROBE,
+    MLVPN_PKT_PROBE_REPLY,
+    MLVPN_PKT_FEC,
+    MLVPN_PKT_NACK,
+    MLVPN_PKT_RETRANSMIT,
+    MLVPN_PKT_DUPLICATE,
+    MLVPN_PKT_BUNDLE
 };
 
-typedef struct {
-    uint16_t len;
-    uint8_t type;
-    uint8_t reorder;
-    uint64_t seq;
-    char data[DEFAULT_MTU];
-} mlvpn_pkt_t;
-
-
 /* packet sent on the wire. 20 bytes headers for mlvpn */
 typedef struct {
     uint16_t len;
@@ -38,7 +36,89 @@ typedef struct {
     char data[DEFAULT_MTU];
 } __attribute__((packed)) mlvpn_proto_t;
 
-#define PKTHDRSIZ(pkt) (sizeof(pkt)-sizeof(pkt.data))
+/* Compact header of protocol version 2, used for every packet but AUTH
+ * and AUTH_OK once the peer announced version 2. The first 4 bytes are
+ * the same as in mlvpn_proto_t: the receiver tells both apart with the
+ * version. seq and data_seq are truncated to their 32 low bits, and
+ * rebuilt by the receiver from the last ones received. flow_id is the
+ * one of the last full header received.
+ * Optional fields follow, in this order: timestamp_reply (16 bits) if
+ * has_reply, data_seq (32 bits, or 64 bits if long_data_seq) if
+ * has_data_seq. */
+typedef struct {
+    uint16_t len;
+    uint16_t version: 4; /* protocol version */
+    uint16_t flags: 6;   /* protocol options */
+    uint16_t reorder: 1; /* do reordering or not */
+    uint16_t has_reply: 1;
+    uint16_t has_data_seq: 1;
+    uint16_t long_data_seq: 1; /* parity packets, see MLVPN_FEC_SEQ */
+    uint16_t unused: 2;
+    uint16_t timestamp;
+    uint32_t seq;
+} __attribute__((packed)) mlvpn_proto2_t;
+
+/* Packets carrying a data_seq */
+#define MLVPN_PKT_HAS_DATA_SEQ(type) ((type) == MLVPN_PKT_DATA || \
+    (type) == MLVPN_PKT_FEC || (type) == MLVPN_PKT_RETRANSMIT || \
+    (type) == MLVPN_PKT_DUPLICATE || (type) == MLVPN_PKT_BUNDLE)
+
+#define MLVPN_PROTO2_HDRSIZ(p) (sizeof(mlvpn_proto2_t) + \
+    ((p)->has_reply ? 2 : 0) + \
+    ((p)->has_data_seq ? ((p)->long_data_seq ? 8 : 4) : 0))
+
+/* Payload of capacity probes, sent as a train of back to back packets.
+ * The receiver answers with the rate measured from the train dispersion */
+typedef struct {
+    uint16_t train;       /* train number */
+    uint8_t idx;          /* packet index in the train */
+    uint8_t count;        /* packets in the train */
+    uint32_t rate;        /* PROBE_REPLY: measured bytes per second */
+} __attribute__((packed)) mlvpn_probe_t;
+
+/* First payload byte of the keepalives sent by the liveness detection:
+ * the peer answers them at once instead of once per second */
+#define MLVPN_KEEPALIVE_ECHO 'E'
+
+/* Parity packets (MLVPN_PKT_FEC) carry in data_seq the first data_seq of
+ * their group, and the number of packets in the group in the top byte */
+#define MLVPN_FEC_SEQ(base, count) ((base) | ((uint64_t)(count) << 56))
+#define MLVPN_FEC_SEQ_BASE(seq) ((seq) & (((uint64_t)1 << 56) - 1))
+#define MLVPN_FEC_SEQ_COUNT(seq) ((uint32_t)((seq) >> 56))
+
+/* NACK packets hold the data_seq requested, 64 bits big endian each.
+ * RETRANSMIT packets are data packets sent again, with their data_seq.
+ * DUPLICATE packets are copies of data packets sent on a second tunnel,
+ * with the same data_seq. */
+
+/* BUNDLE packets hold data packets of consecutive data_seq, starting at
+ * their own data_seq. Each one is prefixed with its length, 16 bits big
+ * endian. */
+#define MLVPN_BUNDLE_HDRSIZ 2
+
+/* Size of the wire header, and room reserved in front of the packet data
+ * so the header and the crypto MAC can be prepended in place */
+#define MLVPN_PROTO_HDRSIZ (sizeof(mlvpn_proto_t) - DEFAULT_MTU)
+#define MLVPN_PKT_HEADROOM (MLVPN_PROTO_HDRSIZ + crypto_PADSIZE)
+
+typedef struct {
+    uint16_t len;
+    uint8_t type;
+    uint8_t reorder;
+    uint8_t duplicate;    /* send a copy on a second tunnel */
+    uint32_t pool_idx;    /* slot in the packet pool */
+    uint32_t hold_idx;    /* freebuffer entry holding the packet */
+    uint64_t seq;
+    char headroom[MLVPN_PKT_HEADROOM];
+    char data[DEFAULT_MTU];
+} mlvpn_pkt_t;
+
+/* Received datagrams are stored from the start of the headroom, so that
+ * the payload is decrypted in place into pkt->data */
+#define MLVPN_PKT_WIRE(pkt) ((pkt)->headroom)
+#define MLVPN_PKT_WIRESIZ (MLVPN_PKT_HEADROOM + DEFAULT_MTU)
+
+#define PKTHDRSIZ(pkt) (sizeof(pkt)-sizeof((pkt).data))
 #define ETH_OVERHEAD 24
 #define IPV4_OVERHEAD 20
 #define TCP_OVERHEAD 20
@@ -91,7 +91,7 @@ static volatile sig_atomic_t cur_state = STATE_INIT;
 static char allowed_configfile[MAXPATHLEN] = {0};
 
 static int root_open_file(char *, int);
-int root_tuntap_open(int tuntapmode, char *devname, int mtu);
+int root_tuntap_open(int tuntapmode, char *devname, int mtu, int multiqueue);
 static int root_launch_script(char *, int, char **, char **);
 static void increase_state(int);
 static void sig_got_chld(int);
@@ -108,6 +108,7 @@ priv_init(char *argv[], char *username)
     int nullfd;
     int mtu;
     int tuntapmode;
+    int multiqueue;
     int env_len;
     size_t len;
     size_t hostname_len, servname_len, addrinfo_len;
@@ -275,9 +276,10 @@ priv_init(char *argv[], char *username)
             if (mtu < 0 || mtu > 1500) {
                 fatalx("priv_open_tun: wrong mtu.");
             }
+            must_read(socks[0], &multiqueue, sizeof(multiqueue));
 
             /* see tuntap_*.c . That's where this is defined. */
-            fd = root_tuntap_open(tuntapmode, tuntapname, mtu);
+            fd = root_tuntap_open(tuntapmode, tuntapname, mtu, multiqueue);
             if (fd < 0)
             {
                 len = 0;
@@ -567,7 +569,7 @@ priv_open_config(char *config_path)
 /* Open tun from unpriviled code
  * Scope: public
  */
-int priv_open_tun(int tuntapmode, char *devname, int mtu)
+int priv_open_tun(int tuntapmode, char *devname, int mtu, int multiqueue)
 {
     int cmd, fd;
     size_t len;
@@ -588,6 +590,7 @@ int priv_open_tun(int tuntapmode, char *devname, int mtu)
     if (len > 0 && devname != NULL)
         must_write(priv_fd, devname, len);
     must_write(priv_fd, &mtu, sizeof(mtu));
+    must_write(priv_fd, &multiqueue, sizeof(multiqueue));
 
     must_read(priv_fd, &len, sizeof(len));
     if (len > 0 && len < MLVPN_IFNAMSIZ && devname != NULL)
@@ -15,7 +15,7 @@ int priv_init(char *argv[], char *username);
 int priv_init_script(char *);
 int priv_open_config(char *);
 void priv_reload_resolver();
-int priv_open_tun(int tuntapmode, char *devname, int mtu);
+int priv_open_tun(int tuntapmode, char *devname, int mtu, int multiqueue);
 int priv_run_script(int argc, char **argv, int env_len, char **env);
 void priv_set_running_state(void);
 int
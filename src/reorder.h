@@ -37,6 +37,9 @@
 
 #include "pkt.h"
 
+/* Default number of packets held before a hole is considered lost */
+#define MLVPN_REORDER_DEPTH 20
+
 /**
  * @file
  * mlvpn reorder
@@ -119,12 +122,11 @@ mlvpn_reorder_free(struct mlvpn_reorder_buffer *b);
  *   pkt that needs to be inserted in reorder buffer.
  * @return
  *   0 on success
- *   -1 on error
- *   On error case, mlvpn_errno will be set appropriately:
- *    - ENOSPC - Cannot move existing pkts from reorder buffer to accommodate
- *      ealry pkt, but it can be accomodated by performing drain and then insert.
- *    - ERANGE - Too early or late pkt which is vastly out of range of expected
- *      window should be ingnored without any handling.
+ *   -1 if the packets pushed out of the window do not fit in the ready
+ *      buffer. Draining and inserting again fixes it.
+ *   -2 if the pkt is late (its sequence number was skipped or already
+ *      drained). It should be delivered without reordering.
+ *   -3 if a pkt with the same sequence number is held already.
  */
 int
 mlvpn_reorder_insert(struct mlvpn_reorder_buffer *b, mlvpn_pkt_t *pkt);
@@ -155,5 +157,16 @@ mlvpn_reorder_drain(struct mlvpn_reorder_buffer *b, mlvpn_pkt_t **pkts,
  * to drain */
 void mlvpn_reorder_skip(struct mlvpn_reorder_buffer *b);
 
+/**
+ * Set the number of packets held behind a hole before the hole is
+ * considered lost and skipped. Capped to the buffer size.
+ */
+void
+mlvpn_reorder_set_depth(struct mlvpn_reorder_buffer *b, unsigned int depth);
+
+/* Number of packets the buffer can hold */
+unsigned int
+mlvpn_reorder_size(struct mlvpn_reorder_buffer *b);
+
 
 #endif /* MLVPN_REORDER_H */
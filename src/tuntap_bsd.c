@@ -15,24 +15,25 @@
 #include "tool.h"
 
 int
-mlvpn_tuntap_read(struct tuntap_s *tuntap)
+mlvpn_tuntap_read(struct tuntap_s *tuntap, int fd)
 {
     ssize_t ret;
-    u_char data[DEFAULT_MTU];
+    mlvpn_pkt_t *pkt = mlvpn_pkt_alloc();
     struct iovec iov[2];
     uint32_t type;
 
     iov[0].iov_base = &type;
     iov[0].iov_len = sizeof(type);
-    iov[1].iov_base = &data;
+    iov[1].iov_base = pkt->data;
     iov[1].iov_len = tuntap->maxmtu;
-    ret = readv(tuntap->fd, iov, 2);
+    ret = readv(fd, iov, 2);
     if (ret < 0) {
         if (errno != EAGAIN && errno != EWOULDBLOCK) {
             /* read error on tuntap is not recoverable. We must die. */
             fatal("tuntap", "unrecoverable read error");
         } else {
             /* false reading from libev read would block, we can't read */
+            mlvpn_pkt_release(pkt);
             return 0;
         }
     } else if (ret == 0) { /* End of file */
@@ -43,7 +44,8 @@ mlvpn_tuntap_read(struct tuntap_s *tuntap)
             (uint32_t)ret, tuntap->maxmtu);
         ret = tuntap->maxmtu;
     }
-    return mlvpn_tuntap_generic_read(data, ret);
+    pkt->len = ret;
+    return mlvpn_tuntap_generic_read(pkt);
 }
 
 int
@@ -81,6 +83,7 @@ mlvpn_tuntap_write(struct tuntap_s *tuntap)
                tuntap->devname, datalen);
         }
     }
+    mlvpn_pkt_release(pkt);
     return datalen;
 }
 int
@@ -100,7 +103,7 @@ mlvpn_tuntap_alloc(struct tuntap_s *tuntap)
         snprintf(tuntap->devname, sizeof(tuntap->devname), "/dev/%s", devname);
 
         if ((fd = priv_open_tun(tuntap->type,
-                tuntap->devname, tuntap->maxmtu)) > 0 )
+                tuntap->devname, tuntap->maxmtu, 0)) > 0 )
             break;
     }
 
@@ -128,7 +131,7 @@ mlvpn_tuntap_alloc(struct tuntap_s *tuntap)
  * Compatibility: BSD
  */
 int
-root_tuntap_open(int tuntapmode, char *devname, int mtu)
+root_tuntap_open(int tuntapmode, char *devname, int mtu, int multiqueue)
 {
     int fd;
 
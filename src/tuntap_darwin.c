@@ -10,17 +10,18 @@
 #include "tool.h"
 
 int
-mlvpn_tuntap_read(struct tuntap_s *tuntap)
+mlvpn_tuntap_read(struct tuntap_s *tuntap, int fd)
 {
     ssize_t ret;
-    u_char data[DEFAULT_MTU];
-    ret = read(tuntap->fd, &data, tuntap->maxmtu);
+    mlvpn_pkt_t *pkt = mlvpn_pkt_alloc();
+    ret = read(fd, pkt->data, tuntap->maxmtu);
     if (ret < 0) {
         if (errno != EAGAIN && errno != EWOULDBLOCK) {
             /* read error on tuntap is not recoverable. We must die. */
             fatal("tuntap", "unrecoverable read error");
         } else {
             /* false reading from libev read would block, we can't read */
+            mlvpn_pkt_release(pkt);
             return 0;
         }
     } else if (ret == 0) { /* End of file */
@@ -31,7 +32,8 @@ mlvpn_tuntap_read(struct tuntap_s *tuntap)
             ret, tuntap->maxmtu);
         ret = tuntap->maxmtu;
     }
-    return mlvpn_tuntap_generic_read(data, ret);
+    pkt->len = ret;
+    return mlvpn_tuntap_generic_read(pkt);
 }
 
 int
@@ -60,6 +62,7 @@ mlvpn_tuntap_write(struct tuntap_s *tuntap)
                tuntap->devname, ret);
         }
     }
+    mlvpn_pkt_release(pkt);
     return ret;
 }
 
@@ -77,7 +80,7 @@ mlvpn_tuntap_alloc(struct tuntap_s *tuntap)
         snprintf(tuntap->devname, sizeof(tuntap->devname), "/dev/%s", devname);
 
         if ((fd = priv_open_tun(tuntap->type,
-                tuntap->devname, tuntap->maxmtu)) > 0 )
+                tuntap->devname, tuntap->maxmtu, 0)) > 0 )
             break;
     }
 
@@ -103,7 +106,7 @@ mlvpn_tuntap_alloc(struct tuntap_s *tuntap)
  * Compatibility: Darwin
  */
 int
-root_tuntap_open(int tuntapmode, char *devname, int mtu)
+root_tuntap_open(int tuntapmode, char *devname, int mtu, int multiqueue)
 {
     int fd;
 
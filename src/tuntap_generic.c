@@ -1,36 +1,55 @@
 #include "mlvpn.h"
 
+/* Queue a packet read from the tuntap device on the chosen tunnel.
+ * The packet is moved by pointer, ownership goes to the send buffer.
+ */
 int
-mlvpn_tuntap_generic_read(u_char *data, uint32_t len)
+mlvpn_tuntap_generic_read(mlvpn_pkt_t *pkt)
 {
     circular_buffer_t *sbuf;
     mlvpn_tunnel_t *rtun = NULL;
-    mlvpn_pkt_t *pkt;
+    uint32_t len = pkt->len;
 
 #ifdef HAVE_FILTERS
-    rtun = mlvpn_filters_choose((uint32_t)len, data);
+    rtun = mlvpn_filters_choose(len, (u_char *)pkt->data);
+    if (rtun && mlvpn_cb_is_full(rtun->hpsbuf)) {
+        /* don't push out a queued high priority packet: the scheduler
+         * picks a tunnel for this one */
+        log_warnx("tuntap", "%s high priority buffer: overflow", rtun->name);
+        rtun = NULL;
+    }
     if (rtun) {
         /* High priority buffer, not reorderd when a filter applies */
         sbuf = rtun->hpsbuf;
     }
 #endif
+    if (!rtun && mlvpn_dup_match(pkt) &&
+            (rtun = mlvpn_rtun_choose_duplicate(NULL)) != NULL) {
+        /* a copy goes to the second fastest tunnel on encapsulation */
+        pkt->duplicate = 1;
+        sbuf = rtun->hpsbuf;
+    }
     if (!rtun) {
         rtun = mlvpn_rtun_choose(len);
         /* Not connected to anyone. read and discard packet. */
-        if (! rtun) 
+        if (! rtun) {
+            mlvpn_pkt_release(pkt);
             return len;
+        }
         sbuf = rtun->sbuf;
     }
     if (mlvpn_cb_is_full(sbuf))
         log_warnx("tuntap", "%s buffer: overflow", rtun->name);
 
-    /* Ask for a free buffer */
-    pkt = mlvpn_pktbuffer_write(sbuf);
-    pkt->len = len;
-    /* TODO: INEFFICIENT COPY */
-    memcpy(pkt->data, data, pkt->len);
+    mlvpn_pktbuffer_push(sbuf, pkt);
+    if (sbuf == rtun->sbuf && mlvpn_rtun_backlogged(rtun) &&
+            mlvpn_rtun_all_backlogged())
+        mlvpn_tuntap_pause();
+    /* a paced tunnel is woken up by its pacing timer */
+    if (sbuf == rtun->sbuf && ev_is_active(&rtun->io_pace))
+        return len;
     if (!ev_is_active(&rtun->io_write) && !mlvpn_cb_is_empty(sbuf)) {
         ev_io_start(EV_DEFAULT_UC, &rtun->io_write);
     }
-    return pkt->len;
+    return len;
 }
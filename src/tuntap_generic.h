@@ -21,20 +21,31 @@ enum tuntap_type {
     MLVPN_TUNTAPMODE_TAP
 };
 
+/* Maximum number of IFF_MULTI_QUEUE queues (Linux) */
+#define MLVPN_TUNTAP_MAXQUEUES 8
+/* Default number of packets read from the device per wakeup */
+#define MLVPN_TUNTAP_READ_BUDGET 64
+
 struct tuntap_s
 {
-    int fd;
+    int fd;               /* first queue, also used for writes */
     int maxmtu;
+    int queues;           /* number of queues opened */
+    int read_budget;      /* maximum packets read per wakeup */
+    int paused;           /* not read: every tunnel is backlogged */
     char devname[MLVPN_IFNAMSIZ];
     enum tuntap_type type;
     circular_buffer_t *sbuf;
     ev_io io_read;
     ev_io io_write;
+    /* additional queues, serviced like the first one */
+    int mq_fd[MLVPN_TUNTAP_MAXQUEUES - 1];
+    ev_io mq_read[MLVPN_TUNTAP_MAXQUEUES - 1];
 };
 
 int mlvpn_tuntap_alloc(struct tuntap_s *tuntap);
-int mlvpn_tuntap_read(struct tuntap_s *tuntap);
+int mlvpn_tuntap_read(struct tuntap_s *tuntap, int fd);
 int mlvpn_tuntap_write(struct tuntap_s *tuntap);
-int mlvpn_tuntap_generic_read(u_char *data, uint32_t len);
+int mlvpn_tuntap_generic_read(mlvpn_pkt_t *pkt);
 
 #endif
@@ -12,14 +12,16 @@
 #include "tool.h"
 
 int
-mlvpn_tuntap_read(struct tuntap_s *tuntap)
+mlvpn_tuntap_read(struct tuntap_s *tuntap, int fd)
 {
     ssize_t ret;
-    u_char data[DEFAULT_MTU];
+    /* read straight into a pool packet, leaving room for the headers */
+    mlvpn_pkt_t *pkt = mlvpn_pkt_alloc();
 
-    ret = read(tuntap->fd, &data, DEFAULT_MTU);
+    ret = read(fd, pkt->data, DEFAULT_MTU);
       
     if (ret<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) {
+      mlvpn_pkt_release(pkt);
       return -1;
     }
     
@@ -34,7 +36,8 @@ mlvpn_tuntap_read(struct tuntap_s *tuntap)
             (uint32_t)ret, tuntap->maxmtu);
         ret = tuntap->maxmtu;
     }
-    return mlvpn_tuntap_generic_read(data, ret);
+    pkt->len = ret;
+    return mlvpn_tuntap_generic_read(pkt);
 }
 
 int
@@ -63,18 +66,32 @@ mlvpn_tuntap_write(struct tuntap_s *tuntap)
                tuntap->devname, ret);
         }
     }
+    mlvpn_pkt_release(pkt);
     return ret;
 }
 
 int
 mlvpn_tuntap_alloc(struct tuntap_s *tuntap)
 {
-    int fd;
+    int fd, i;
+    int multiqueue = tuntap->queues > 1;
 
     if ((fd = priv_open_tun(tuntap->type,
-                            tuntap->devname, tuntap->maxmtu)) <= 0 )
+                            tuntap->devname, tuntap->maxmtu,
+                            multiqueue)) <= 0 )
         fatalx("failed to open /dev/net/tun read/write");
     tuntap->fd = fd;
+    /* devname now holds the name chosen by the kernel, every
+     * other queue attaches to the same interface */
+    for (i = 1; i < tuntap->queues; i++) {
+        if ((tuntap->mq_fd[i - 1] = priv_open_tun(tuntap->type,
+                tuntap->devname, tuntap->maxmtu, multiqueue)) <= 0) {
+            log_warnx("tuntap", "%s unable to open queue %d, "
+                "using %d queue(s)", tuntap->devname, i, i);
+            tuntap->queues = i;
+            break;
+        }
+    }
     return fd;
 }
 
@@ -83,10 +100,10 @@ mlvpn_tuntap_alloc(struct tuntap_s *tuntap)
  * Really open the tun device.
  * returns tun file descriptor.
  *
- * Compatibility: Linux 2.4+
+ * Compatibility: Linux 2.4+ (multiqueue: Linux 3.8+)
  */
 int
-root_tuntap_open(int tuntapmode, char *devname, int mtu)
+root_tuntap_open(int tuntapmode, char *devname, int mtu, int multiqueue)
 {
     struct ifreq ifr;
     int fd, sockfd;
@@ -104,6 +121,10 @@ root_tuntap_open(int tuntapmode, char *devname, int mtu)
         /* We do not want kernel packet info (IFF_NO_PI) */
         ifr.ifr_flags |= IFF_NO_PI;
 
+        /* Every open(2) attaches one more queue to the interface */
+        if (multiqueue)
+            ifr.ifr_flags |= IFF_MULTI_QUEUE;
+
         /* Allocate with specified name, otherwise the kernel
          * will find a name for us. */
         if (*devname)
@@ -3,43 +3,160 @@
 /* Fairly big no ? */
 #define MAX_TUNNELS 128
 
-struct mlvpn_wrr {
+/* Stride scheduler
+ * Every tunnel advances its own "pass" by a stride inversely
+ * proportional to its weight each time it is chosen. The tunnel with the
+ * lowest pass goes next. Tunnels are kept in a binary heap ordered by
+ * pass, so choosing costs O(log n) whatever the number of tunnels.
+ * Tunnels which spent their quota are parked in a second heap until
+ * their token bucket refills. Tunnels with a backlog in their send
+ * buffer are parked in a third heap until it drains below
+ * MLVPN_SBUF_LOWWATER.
+ */
+
+/* Weight given to tunnels with a null weight (barely used) */
+#define WRR_MIN_WEIGHT 0.01
+
+struct wrr_entry {
+    mlvpn_tunnel_t *tunnel;
+    double pass;
+    double stride;
+    struct wrr_heap *heap;
+    int pos;
+};
+
+struct wrr_heap {
     int len;
-    mlvpn_tunnel_t *tunnel[MAX_TUNNELS];
-    double tunval[MAX_TUNNELS];
+    struct wrr_entry *entry[MAX_TUNNELS];
 };
 
-static struct mlvpn_wrr wrr = {
-    0,
-    {NULL},
-    {0}
+struct mlvpn_wrr {
+    int len;
+    double vtime;   /* pass of the last chosen tunnel */
+    struct wrr_entry entries[MAX_TUNNELS];
+    struct wrr_heap ready;      /* tunnels allowed to send */
+    struct wrr_heap blocked;    /* tunnels out of quota */
+    struct wrr_heap backlogged; /* tunnels with a backlog */
+    ev_tstamp unblock_at;       /* when the first blocked tunnel refills */
 };
 
-static int wrr_min_index()
+static struct mlvpn_wrr wrr;
+
+static double wrr_stride(mlvpn_tunnel_t *t)
 {
-    int min_index = 0;
-    int i;
-    double min = wrr.tunval[0];
+    return 1.0 / (t->weight > WRR_MIN_WEIGHT ? t->weight : WRR_MIN_WEIGHT);
+}
 
-    for(i = 0; i < wrr.len; i++)
-    {
-      if ((wrr.tunval[i] < min) &&
-          (wrr.tunnel[i]->quota==0 || wrr.tunnel[i]->permitted>0))
-        {
-            min = wrr.tunval[i];
-            min_index = i;
-        }
+static int wrr_eligible(mlvpn_tunnel_t *t)
+{
+    return t->quota == 0 || mlvpn_rtun_tokens(t) > 0;
+}
+
+static void wrr_heap_set(struct wrr_heap *h, int pos, struct wrr_entry *e)
+{
+    h->entry[pos] = e;
+    e->pos = pos;
+}
+
+static void wrr_heap_up(struct wrr_heap *h, int pos)
+{
+    struct wrr_entry *e = h->entry[pos];
+    while (pos > 0) {
+        int parent = (pos - 1) / 2;
+        if (h->entry[parent]->pass <= e->pass)
+            break;
+        wrr_heap_set(h, pos, h->entry[parent]);
+        pos = parent;
+    }
+    wrr_heap_set(h, pos, e);
+}
+
+static void wrr_heap_down(struct wrr_heap *h, int pos)
+{
+    struct wrr_entry *e = h->entry[pos];
+    for(;;) {
+        int child = pos * 2 + 1;
+        if (child >= h->len)
+            break;
+        if (child + 1 < h->len &&
+                h->entry[child + 1]->pass < h->entry[child]->pass)
+            child++;
+        if (e->pass <= h->entry[child]->pass)
+            break;
+        wrr_heap_set(h, pos, h->entry[child]);
+        pos = child;
+    }
+    wrr_heap_set(h, pos, e);
+}
+
+static void wrr_heap_push(struct wrr_heap *h, struct wrr_entry *e)
+{
+    e->heap = h;
+    wrr_heap_set(h, h->len++, e);
+    wrr_heap_up(h, e->pos);
+}
+
+static void wrr_heap_remove(struct wrr_entry *e)
+{
+    struct wrr_heap *h = e->heap;
+    struct wrr_entry *last = h->entry[--h->len];
+    e->heap = NULL;
+    if (last == e)
+        return;
+    wrr_heap_set(h, e->pos, last);
+    wrr_heap_up(h, last->pos);
+    wrr_heap_down(h, last->pos);
+}
+
+static void wrr_block(struct wrr_entry *e)
+{
+    ev_tstamp at = ev_now(EV_DEFAULT_UC) + mlvpn_rtun_tokens_wait(e->tunnel);
+    if (wrr.blocked.len == 0 || at < wrr.unblock_at)
+        wrr.unblock_at = at;
+    wrr_heap_push(&wrr.blocked, e);
+}
+
+/* Move the tunnels whose bucket refilled back to the ready heap */
+static void wrr_unblock_expired()
+{
+    int i, n = 0;
+    struct wrr_entry *e, *refilled[MAX_TUNNELS];
+    ev_tstamp at, now = ev_now(EV_DEFAULT_UC);
+
+    if (wrr.blocked.len == 0 || now < wrr.unblock_at)
+        return;
+    /* removing reorders the heap: collect first */
+    for (i = 0; i < wrr.blocked.len; i++) {
+        if (wrr_eligible(wrr.blocked.entry[i]->tunnel))
+            refilled[n++] = wrr.blocked.entry[i];
+    }
+    for (i = 0; i < n; i++) {
+        e = refilled[i];
+        wrr_heap_remove(e);
+        if (e->pass < wrr.vtime)
+            e->pass = wrr.vtime;
+        wrr_heap_push(&wrr.ready, e);
+    }
+    for (i = 0; i < wrr.blocked.len; i++) {
+        at = now + mlvpn_rtun_tokens_wait(wrr.blocked.entry[i]->tunnel);
+        if (i == 0 || at < wrr.unblock_at)
+            wrr.unblock_at = at;
     }
-    return min_index;
 }
 
 /* initialize wrr system */
 int mlvpn_rtun_wrr_reset(struct rtunhead *head, int use_fallbacks)
 {
     mlvpn_tunnel_t *t;
+    struct wrr_entry *e;
     wrr.len = 0;
+    wrr.vtime = 0.0;
+    wrr.ready.len = 0;
+    wrr.blocked.len = 0;
+    wrr.backlogged.len = 0;
     LIST_FOREACH(t, head, entries)
     {
+        t->wrr_slot = -1;
         if (t->fallback_only != use_fallbacks) {
             continue;
         }
@@ -49,8 +166,15 @@ int mlvpn_rtun_wrr_reset(struct rtunhead *head, int use_fallbacks)
         {
             if (wrr.len >= MAX_TUNNELS)
                 fatalx("You have too much tunnels declared");
-            wrr.tunnel[wrr.len] = t;
-            wrr.tunval[wrr.len] = 0.0;
+            e = &wrr.entries[wrr.len];
+            e->tunnel = t;
+            e->stride = wrr_stride(t);
+            e->pass = e->stride;
+            t->wrr_slot = wrr.len;
+            if (wrr_eligible(t))
+                wrr_heap_push(&wrr.ready, e);
+            else
+                wrr_block(e);
             wrr.len++;
         }
     }
@@ -60,36 +184,122 @@ int mlvpn_rtun_wrr_reset(struct rtunhead *head, int use_fallbacks)
 
 void mlvpn_rtun_set_weight(mlvpn_tunnel_t *t, double weight)
 {
+  struct wrr_entry *e;
   if (t->weight!=weight) {
     t->weight=weight;
-    for (int i = 0; i< wrr.len; i++) {
-      wrr.tunval[i] = 0.0;
-    }
+    if (t->wrr_slot < 0 || t->wrr_slot >= wrr.len)
+      return;
+    /* restart the tunnel from now, at its new pace */
+    e = &wrr.entries[t->wrr_slot];
+    e->stride = wrr_stride(t);
+    e->pass = wrr.vtime + e->stride;
+    wrr_heap_up(e->heap, e->pos);
+    wrr_heap_down(e->heap, e->pos);
   }
 }
 
+/* The tunnel quota changed: make it eligible again if it can send */
+void mlvpn_rtun_wrr_unblock(mlvpn_tunnel_t *t)
+{
+  struct wrr_entry *e;
+  if (t->wrr_slot < 0 || t->wrr_slot >= wrr.len)
+    return;
+  e = &wrr.entries[t->wrr_slot];
+  if (e->heap != &wrr.blocked || !wrr_eligible(t))
+    return;
+  wrr_heap_remove(e);
+  /* no credit for the time spent blocked */
+  if (e->pass < wrr.vtime)
+    e->pass = wrr.vtime;
+  wrr_heap_push(&wrr.ready, e);
+}
+
+/* The send buffer of the tunnel went below MLVPN_SBUF_LOWWATER: make it
+ * eligible again if it was parked for its backlog */
+void mlvpn_rtun_wrr_drained(mlvpn_tunnel_t *t)
+{
+  struct wrr_entry *e;
+  if (t->wrr_slot < 0 || t->wrr_slot >= wrr.len)
+    return;
+  e = &wrr.entries[t->wrr_slot];
+  if (e->heap != &wrr.backlogged)
+    return;
+  wrr_heap_remove(e);
+  if (e->pass < wrr.vtime)
+    e->pass = wrr.vtime;
+  if (wrr_eligible(t))
+    wrr_heap_push(&wrr.ready, e);
+  else
+    wrr_block(e);
+}
+
 mlvpn_tunnel_t *
 mlvpn_rtun_wrr_choose()
 {
+  struct wrr_heap *h = &wrr.ready;
+  struct wrr_entry *e;
 
-  int idx = wrr_min_index();
-  
-  double total=0;
-  for (int i = 0; i< wrr.len; i++) {
-    total+= wrr.tunnel[i]->weight;
+  wrr_unblock_expired();
+  /* park the tunnels which spent their quota, or have a backlog */
+  while (h->len > 0) {
+    e = h->entry[0];
+    if (!wrr_eligible(e->tunnel)) {
+      wrr_heap_remove(e);
+      wrr_block(e);
+    } else if (mlvpn_rtun_backlogged(e->tunnel)) {
+      wrr_heap_remove(e);
+      wrr_heap_push(&wrr.backlogged, e);
+    } else {
+      break;
+    }
   }
-  
-  if (wrr.tunval[idx]<=0 || wrr.tunval[idx] > 10000) {
-    for (int i = 0; i< wrr.len; i++) {
-      if (wrr.tunnel[i]->weight) {
-        wrr.tunval[i]=total / wrr.tunnel[i]->weight;
-      } else {
-        wrr.tunval[i]=wrr.len; // handle initial setup fairly
-      }      
+  /* every tunnel is backlogged or out of quota: keep sending anyway */
+  if (h->len == 0)
+    h = &wrr.backlogged;
+  if (h->len == 0)
+    h = &wrr.blocked;
+  if (h->len == 0)
+    return NULL;
+
+  e = h->entry[0];
+  wrr.vtime = e->pass;
+  e->pass += e->stride;
+  wrr_heap_down(h, e->pos);
+  return e->tunnel;
+}
+
+/* Assumed upload rate of tunnels of unknown bandwidth (10Mbit/s) */
+#define EARLIEST_DEFAULT_RATE 1250000.0
+
+/* Earliest arrival
+ * Predict when a packet of len bytes would reach the other side on each
+ * tunnel: the data queued in front of it drains at the link bandwidth,
+ * then it travels for half the round trip time. Pick the earliest.
+ */
+mlvpn_tunnel_t *
+mlvpn_rtun_earliest_choose(uint32_t len)
+{
+  int i;
+  mlvpn_tunnel_t *t, *best = NULL;
+  double eta, best_eta = 0;
+  double rate;
+
+  for (i = 0; i < wrr.len; i++) {
+    t = wrr.entries[i].tunnel;
+    if (!wrr_eligible(t) || mlvpn_rtun_backlogged(t))
+      continue;
+    rate = mlvpn_rtun_bandwidth(t);
+    if (!rate)
+      rate = EARLIEST_DEFAULT_RATE;
+    eta = ((mlvpn_pktbuffer_bytes(t->sbuf) + len) * 1000.0 / rate) +
+      (t->srtt / 2);
+    if (!best || eta < best_eta) {
+      best = t;
+      best_eta = eta;
     }
-  } else {
-    wrr.tunval[idx]+=total / wrr.tunnel[idx]->weight;
   }
-  
-  return wrr.tunnel[idx];
+  /* every tunnel is out of quota or backlogged */
+  if (!best)
+    return mlvpn_rtun_wrr_choose();
+  return best;
 }